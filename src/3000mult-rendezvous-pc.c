@@ -28,170 +28,194 @@
 #include <errno.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <time.h>
+
+#include "words.h"
+#include "intern.h"
+#include "proc.h"
 
 #define QUEUESIZE 32
-#define WORDSIZE 16
-
-const int wordlist_size = 27;
-const char *wordlist[] = {
-    "Alpha",
-    "Bravo",
-    "Charlie",
-    "Delta",
-    "Echo",
-    "Foxtrot",
-    "Golf",
-    "Hotel",
-    "India",
-    "Juliet",
-    "Kilo",
-    "Lima",
-    "Mike",
-    "November",
-    "Oscar",
-    "Papa",
-    "Quebec",
-    "Romeo",
-    "Sierra",
-    "Tango",
-    "Uniform",
-    "Victor",
-    "Whiskey",
-    "X-ray",
-    "Yankee",
-    "Zulu",
-    "Dash"
-};
-
-typedef struct entry {
-    char word[WORDSIZE];
-} entry;
+/* Publication slots for -f, so at most this many producers plus consumers */
+#define MAX_PROCESSES 64
+
+#define QUEUE_NAME     wordq
+#define QUEUE_TYPE     word_t
+#define QUEUE_CAPACITY QUEUESIZE
+#define QUEUE_POLICY   QUEUE_MPMC
+#define QUEUE_COMBINING MAX_PROCESSES
+#define QUEUE_QLOCK    QLOCK_MUTEX
+#include "queue.h"
+
+/* Compact mode sends interned word ids instead of whole words */
+#define QUEUE_NAME     idq
+#define QUEUE_TYPE     word_id
+#define QUEUE_CAPACITY QUEUESIZE
+#define QUEUE_POLICY   QUEUE_MPMC
+#define QUEUE_COMBINING MAX_PROCESSES
+#define QUEUE_QLOCK    QLOCK_MUTEX
+#include "queue.h"
 
 typedef struct shared {
-    pthread_mutex_t cond_mutex;
-    pthread_cond_t queue_nonempty;
-    pthread_cond_t queue_nonfull;
-    entry queue[QUEUESIZE];
-    int last_produced;
-    int last_consumed;
-    int prod_count;
-    int con_count;
+    int compact;            /* use ids and names instead of queue */
+    int overflow;           /* what queue_word does when the queue is full */
+    int timeout_ms;
+    int combining;          /* use flat combining (fc_push/fc_pop) */
+    int lock;               /* kind of queue lock */
+    int spill_fd;
+    wordq queue;
+    idq ids;
+    intern_table names;
+    int producers_left;     /* producers that have not finished yet */
+    int iterations;         /* runs the same processes do, with -k */
+    pthread_barrier_t barrier;  /* everyone meets here between runs */
+    long first_ns;          /* when this run's first word was consumed */
+    long last_ns;           /* ... and its last */
 } shared;
 
-
-void report_error(char *error)
-{
-    fprintf(stderr, "Error: %s\n", error);
-}
-
 void usage_exit(char *progname)
 {
     fprintf(stderr,
-            "Usage: %s <event count> <prod interval int> <con interval int>\n",
+            "Usage: %s [-p producers] [-c consumers] [-I] "
+            "[-o block|timeout:<ms>|drop|overwrite|spill:<file>] [-d] [-f] [-L mutex|ticket] [-k runs] "
+            "<event count> <prod interval int> <con interval int>\n"
+            "  <event count> is the number of words each producer queues\n"
+            "  -I sends interned word ids instead of whole words\n"
+            "  -o spill:<file> appends words to file while the queue is full instead\n"
+            "     of waiting; consumers read them back in order, and the file is\n"
+            "     truncated whenever they catch up\n"
+            "  -d lets consumers take every ready word at once\n"
+            "  -f uses flat combining: whoever holds the queue lock does every\n"
+            "     process's pending push or pop in one pass (not with -o or -d)\n"
+            "  -L picks the queue lock: a pthread mutex (default) or a fair\n"
+            "     ticket lock; either way each process's use of it is reported\n"
+            "  -k repeats the run k times with the same processes, resetting the\n"
+            "     queue in between, and reports startup and each run separately\n",
             progname);
     exit(-1);
 }
 
-void pick_word(char *word)
+/* Returns non-zero if the word was dropped or timed out. me is the
+ * process's publication slot for flat combining. */
+int queue_word(char *word, shared *s, int me)
 {
-    unsigned int pick;
+    word_id id;
+    int ret;
 
-    /* Open /dev/urandom for reading */
-    int fd = open("/dev/urandom", O_RDONLY);
-    if (fd < 0)
-    {
-        fprintf(stderr, "Error: Unable to open /dev/urandom for reading: %s\n", strerror(errno));
-        pick = 0;
-    }
-    else if (read(fd, (void *)&pick, sizeof(pick)) == -1)
+    if (!s->compact && s->combining)
+        return wordq_fc_push(&s->queue, me, (const word_t *) word);
+    if (!s->compact)
+        return wordq_offer(&s->queue, (const word_t *) word, s->overflow, s->timeout_ms);
+
+    if ((ret = intern(&s->names, word)) < 0)
     {
-        fprintf(stderr, "Error: Unable to read from /dev/urandom: %s\n",strerror(errno));
-        pick = 0;
+        report_error("Intern table is full");
+        return -1;
     }
+    id = ret;
+    if (s->combining)
+        return idq_fc_push(&s->ids, me, &id);
+    return idq_offer(&s->ids, &id, s->overflow, s->timeout_ms);
+}
 
-    pick = pick % wordlist_size;
+/* Returns the next word, or NULL once the queue is empty and every
+ * producer has finished. In compact mode the word comes straight from
+ * the intern table and buf is not touched. */
+char *get_next_word(char *buf, shared *s, int me)
+{
+    word_id id;
 
-    strcpy(word, wordlist[pick]);
+    if (!s->compact && s->combining)
+        return wordq_fc_pop(&s->queue, me, (word_t *) buf) == 0 ? buf : NULL;
+    if (!s->compact)
+        return wordq_pop(&s->queue, (word_t *) buf) == 0 ? buf : NULL;
 
-    close(fd);
+    if (s->combining ? idq_fc_pop(&s->ids, me, &id) != 0 : idq_pop(&s->ids, &id) != 0)
+        return NULL;
+    return intern_word(&s->names, id);
 }
 
-void wait_for_producer(shared *s)
+/* Takes every word that is ready, up to QUEUESIZE, waking producers once.
+ * words[] is pointed at each word, as for get_next_word. Returns how many
+ * were taken, or -1 once the queue is empty and every producer has finished. */
+int get_next_words(word_t *bufs, char **words, shared *s)
 {
-    fprintf(stderr, "Waiting for producer...\n");
-    pthread_cond_wait(&s->queue_nonempty, &s->cond_mutex);
+    word_id ids[QUEUESIZE];
+    int i, n;
+
+    if (!s->compact)
+    {
+        n = wordq_drain(&s->queue, bufs, QUEUESIZE);
+        for (i = 0; i < n; i++)
+            words[i] = bufs[i];
+        return n;
+    }
+
+    n = idq_drain(&s->ids, ids, QUEUESIZE);
+    for (i = 0; i < n; i++)
+        words[i] = intern_word(&s->names, ids[i]);
+    return n;
 }
 
-void wait_for_consumer(shared *s)
+int produced(shared *s)
 {
-    fprintf(stderr, "Waiting for consumer...\n");
-    pthread_cond_wait(&s->queue_nonfull, &s->cond_mutex);
+    return s->compact ? s->ids.prod_count : s->queue.prod_count;
 }
 
-void output_word(int c, char *w)
+int consumed(shared *s)
 {
-    printf("Word %d: %s\n", c, w);
+    return s->compact ? s->ids.con_count : s->queue.con_count;
 }
 
-int queue_word(char *word, shared *s)
+queue_overflow_stats *overflow_stats(shared *s)
 {
-    pthread_mutex_lock(&s->cond_mutex);
-    entry *e;
-    int current;
-
-    current = (s->last_produced + 1) % QUEUESIZE;
-    e = &s->queue[current];
-
-    while (e->word[0] != '\0')
-    {
-        /* consumer hasn't consumed this entry yet */
-        wait_for_consumer(s);
-        current = (s->last_produced + 1) % QUEUESIZE;
-        e = &s->queue[current];
-    }
+    return s->compact ? &s->ids.overflow : &s->queue.overflow;
+}
 
-    strncpy(e->word, word, WORDSIZE);
-    s->last_produced = current;
-    s->prod_count++;
-    /* Notify that queue is nonempty */
-    pthread_cond_broadcast(&s->queue_nonempty);
+queue_wakeup_stats *wakeup_stats(shared *s)
+{
+    return s->compact ? &s->ids.wakeups : &s->queue.wakeups;
+}
 
-    pthread_mutex_unlock(&s->cond_mutex);
-    return 0;
+qlock *queue_lock(shared *s)
+{
+    return s->compact ? &s->ids.cond_mutex : &s->queue.cond_mutex;
 }
 
-int get_next_word(char *word, shared *s)
+queue_spill_stats *spill_stats(shared *s)
 {
-    pthread_mutex_lock(&s->cond_mutex);
-    entry *e;
-    int current;
+    return s->compact ? &s->ids.spill : &s->queue.spill;
+}
 
-    current = (s->last_consumed + 1) % QUEUESIZE;
-    e = &s->queue[current];
+queue_combining_stats *combining_stats(shared *s)
+{
+    return s->compact ? &s->ids.combining : &s->queue.combining;
+}
 
-    while (e->word[0] == '\0')
+void producer_done(shared *s)
+{
+    /* The last producer closes the queue, waking every waiting consumer */
+    if (__atomic_sub_fetch(&s->producers_left, 1, __ATOMIC_ACQ_REL) == 0)
     {
-        /* producer hasn't filled in this entry yet */
-        wait_for_producer(s);
-        current = (s->last_consumed + 1) % QUEUESIZE;
-        e = &s->queue[current];
+        if (s->compact)
+            idq_close(&s->ids);
+        else
+            wordq_close(&s->queue);
     }
+}
 
-    strncpy(word, e->word, WORDSIZE);
-    e->word[0] = '\0';
-    s->last_consumed = current;
-    s->con_count++;
-
-    /* Notify that queue is nonfull */
-    pthread_cond_broadcast(&s->queue_nonfull);
-
-    pthread_mutex_unlock(&s->cond_mutex);
-    return 0;
+/* With -k every process waits here once it has started, then before and
+   after each run, so the parent can reset the queue while nobody is
+   using it */
+void iteration_wait(shared *s)
+{
+    if (s->iterations > 1)
+        pthread_barrier_wait(&s->barrier);
 }
 
-void producer(shared *s, int event_count, int prod_interval)
+void produce_words(shared *s, int me, int event_count, int prod_interval)
 {
     char word[WORDSIZE];
     int i;
@@ -199,7 +223,7 @@ void producer(shared *s, int event_count, int prod_interval)
     for (i=0; i < event_count; i++)
     {
         pick_word(word);
-        queue_word(word, s);
+        queue_word(word, s, me);
 
         /* Don't sleep if interval <= 0 */
         if (prod_interval <= 0)
@@ -212,105 +236,279 @@ void producer(shared *s, int event_count, int prod_interval)
         }
     }
 
+    producer_done(s);
+}
+
+void producer(shared *s, int me, int event_count, int prod_interval)
+{
+    int k;
+
+    /* with -k, once to say we've started, so run 1 doesn't count that */
+    iteration_wait(s);
+    for (k = 0; k < s->iterations; k++)
+    {
+        iteration_wait(s);
+        produce_words(s, me, event_count, prod_interval);
+        iteration_wait(s);
+    }
+
     fprintf(stderr, "Producer finished.\n");
     exit(0);
 }
 
-void consumer(shared *s, int event_count, int con_interval)
+void consume_words(shared *s, int me, int con_interval, int drain)
 {
-    char word[WORDSIZE];
-    int i;
+    word_t bufs[QUEUESIZE];
+    char *words[QUEUESIZE];
+    long first = 0, last = 0, seen;
+    int i, k, n;
 
-    for (i=0; i < event_count; i++)
+    /* Keep consuming until the queue is drained and closed */
+    for (i=0; ; )
     {
-        get_next_word(word, s);
-        output_word(s->con_count, word);
+        if (drain)
+            n = get_next_words(bufs, words, s);
+        else
+            n = (words[0] = get_next_word(bufs[0], s, me)) != NULL ? 1 : -1;
+        if (n < 0)
+            break;
 
-        /* Don't sleep if interval <= 0 */
-        if (con_interval <= 0)
-            continue;
-        /* Sleep if we hit our interval */
-        if (i % con_interval == 0)
+        /* only timed when there are runs to compare */
+        if (s->iterations > 1)
         {
-            fprintf(stderr, "Consumer sleeping for 1 second...\n");
-            sleep(1);
+            last = now_ns();
+            if (!first)
+                first = last;
+        }
+
+        for (k=0; k < n; k++, i++)
+        {
+            output_word(consumed(s), words[k]);
+
+            /* Don't sleep if interval <= 0 */
+            if (con_interval <= 0)
+                continue;
+            /* Sleep if we hit our interval */
+            if (i % con_interval == 0)
+            {
+                fprintf(stderr, "Consumer sleeping for 1 second...\n");
+                sleep(1);
+            }
         }
     }
 
-    fprintf(stderr, "Consumer finished.\n");
-    exit(0);
+    if (!first)
+        return;
+
+    /* keep the earliest first word and latest last word of any consumer */
+    seen = __atomic_load_n(&s->first_ns, __ATOMIC_RELAXED);
+    while ((!seen || first < seen) &&
+           !__atomic_compare_exchange_n(&s->first_ns, &seen, first, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    seen = __atomic_load_n(&s->last_ns, __ATOMIC_RELAXED);
+    while (last > seen &&
+           !__atomic_compare_exchange_n(&s->last_ns, &seen, last, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
 }
 
-void init_shared(shared *s)
+void consumer(shared *s, int me, int con_interval, int drain)
 {
-    int i;
+    int k;
 
-    /* We need to explicitly mark the mutex as shared or risk undefined behavior */
-    pthread_mutexattr_t mattr = {};
-    pthread_mutexattr_setpshared(&mattr, 1);
-    pthread_mutex_init(&s->cond_mutex, &mattr);
-
-    /* We need to explicitly mark the conditions as shared or risk undefined behavior */
-    pthread_condattr_t cattr = {};
-    pthread_condattr_setpshared(&cattr, 1);
-    pthread_cond_init(&s->queue_nonempty, &cattr);
-    pthread_cond_init(&s->queue_nonfull, &cattr);
-
-    s->last_consumed = -1;
-    s->last_produced = -1;
+    /* with -k, once to say we've started, so run 1 doesn't count that */
+    iteration_wait(s);
+    for (k = 0; k < s->iterations; k++)
+    {
+        iteration_wait(s);
+        consume_words(s, me, con_interval, drain);
+        iteration_wait(s);
+    }
 
-    s->prod_count = 0;
-    s->con_count  = 0;
+    fprintf(stderr, "Consumer finished.\n");
+    exit(0);
+}
 
-    for (i=0; i<QUEUESIZE; i++)
+/* Everything a run uses up; done again before each run with -k */
+void reset_queues(shared *s, int producers)
+{
+    wordq_init(&s->queue);
+    wordq_set_lock(&s->queue, s->lock);
+    idq_init(&s->ids);
+    idq_set_lock(&s->ids, s->lock);
+    if (s->spill_fd >= 0)
     {
-        s->queue[i].word[0] = '\0';
+        wordq_set_spill(&s->queue, s->spill_fd);
+        idq_set_spill(&s->ids, s->spill_fd);
     }
+
+    s->producers_left = producers;
+    s->first_ns = 0;
+    s->last_ns = 0;
 }
 
-void create_consumer(shared *s, int event_count, int con_interval)
+void init_shared(shared *s, int producers, int consumers, int compact, int overflow,
+                 int timeout_ms, int combining, int lock, int spill_fd, int iterations)
 {
-    int pid = fork();
+    pthread_barrierattr_t battr;
+
+    s->compact = compact;
+    s->combining = combining;
+    s->overflow = overflow;
+    s->timeout_ms = timeout_ms;
+    s->lock = lock;
+    s->spill_fd = spill_fd;
+    s->iterations = iterations;
+
+    /* every producer and consumer, plus the parent */
+    pthread_barrierattr_init(&battr);
+    pthread_barrierattr_setpshared(&battr, PTHREAD_PROCESS_SHARED);
+    pthread_barrier_init(&s->barrier, &battr, producers + consumers + 1);
+    pthread_barrierattr_destroy(&battr);
+
+    reset_queues(s, producers);
+    intern_init(&s->names);
+}
+
+pid_t create_consumer(shared *s, int me, int con_interval, int drain)
+{
+    pid_t pid = fork_or_die();
     if (!pid)
     {
-        consumer(s, event_count, con_interval);
+        qlock_set_self(me);
+        consumer(s, me, con_interval, drain);
         exit(0);
     }
+    return pid;
 }
 
-void create_producer(shared *s, int event_count, int prod_interval)
+pid_t create_producer(shared *s, int me, int event_count, int prod_interval)
 {
-    int pid = fork();
+    pid_t pid = fork_or_die();
     if (!pid)
     {
-        producer(s, event_count, prod_interval);
+        qlock_set_self(me);
+        producer(s, me, event_count, prod_interval);
         exit(0);
     }
+    return pid;
+}
+
+void report_throughput(shared *s, int producers, int consumers, double secs)
+{
+    fprintf(stderr, "%d producer(s) x %d consumer(s): %d produced, %d consumed "
+            "in %.3f s (%.0f words/s)\n",
+            producers, consumers, produced(s), consumed(s), secs,
+            secs > 0 ? consumed(s) / secs : 0.0);
+}
+
+/* Time from the start of a run to its first consumed word, and the rate
+   from then on to the last one, so warm-up and steady state are apart */
+void report_iteration(shared *s, int k, long start_ns, long end_ns)
+{
+    double first = s->first_ns ? (s->first_ns - start_ns) / 1e3 : 0.0;
+    double steady = (s->last_ns - s->first_ns) / 1e9;
+
+    fprintf(stderr, "Run %d: first word after %.1f us, %d consumed in %.3f s, "
+            "steady state %.0f words/s\n", k + 1, first, consumed(s),
+            (end_ns - start_ns) / 1e9,
+            steady > 0 ? (consumed(s) - 1) / steady : 0.0);
+}
+
+/* Overwritten words were queued but never consumed */
+int check_counts(shared *s)
+{
+    if (consumed(s) != produced(s) - overflow_stats(s)->overwrites)
+    {
+        fprintf(stderr, "Error: %d words produced but %d consumed\n",
+                produced(s), consumed(s));
+        return -1;
+    }
+
+    return 0;
 }
 
 int main(int argc, char *argv[])
 {
     int count, prod_interval, con_interval;
+    int producers = 2, consumers = 2, compact = 0;
+    int overflow = QUEUE_BLOCK, timeout_ms = 0, drain = 0, combining = 0;
+    int lock = QLOCK_MUTEX, spill_fd = -1;
+    const char *spill_path = NULL;
+    int iterations = 1, i, k, opt, failed, bad = 0;
+    long setup_ns, run_ns;
+    struct timespec start, end;
 
     shared *s;
 
-    if (argc < 4)
+    while ((opt = getopt(argc, argv, "p:c:Io:dfL:k:")) != -1)
     {
-        if (argc < 1)
-        {
-            report_error("no command line");
-            usage_exit(argv[0]);
-        }
-        else
+        switch (opt)
         {
-            report_error("Not enough arguments");
-            usage_exit(argv[0]);
+            case 'p':
+                producers = atoi(optarg);
+                break;
+            case 'c':
+                consumers = atoi(optarg);
+                break;
+            case 'I':
+                compact = 1;
+                break;
+            case 'o':
+                if (queue_parse_overflow(optarg, &overflow, &timeout_ms, &spill_path))
+                    usage_exit(argv[0]);
+                break;
+            case 'd':
+                drain = 1;
+                break;
+            case 'f':
+                combining = 1;
+                break;
+            case 'L':
+                if (qlock_parse(optarg, &lock))
+                    usage_exit(argv[0]);
+                break;
+            case 'k':
+                iterations = atoi(optarg);
+                break;
+            default:
+                usage_exit(argv[0]);
         }
     }
 
-    count = atoi(argv[1]);
-    prod_interval = atoi(argv[2]);
-    con_interval = atoi(argv[3]);
+    if (producers < 1 || consumers < 1)
+    {
+        report_error("Need at least one producer and one consumer");
+        usage_exit(argv[0]);
+    }
+
+    if (iterations < 1)
+    {
+        report_error("Need at least one run");
+        usage_exit(argv[0]);
+    }
+
+    if (combining && (overflow != QUEUE_BLOCK || drain || producers + consumers > MAX_PROCESSES))
+    {
+        fprintf(stderr, "Error: -f works with blocking pushes, single pops and at most "
+                "%d processes\n", MAX_PROCESSES);
+        usage_exit(argv[0]);
+    }
+
+    if (argc - optind < 3)
+    {
+        report_error("Not enough arguments");
+        usage_exit(argv[0]);
+    }
+
+    count = atoi(argv[optind]);
+    prod_interval = atoi(argv[optind + 1]);
+    con_interval = atoi(argv[optind + 2]);
+
+    /* startup is everything from here until the children are all
+       waiting for the first run, with -k */
+    setup_ns = now_ns();
 
     s = (shared *) mmap(NULL, sizeof(shared),
             PROT_READ|PROT_WRITE,
@@ -322,13 +520,75 @@ int main(int argc, char *argv[])
         exit(-1);
     }
 
-    init_shared(s);
+    /* Opened before forking so every process shares it */
+    if (spill_path && (spill_fd = open(spill_path, O_RDWR|O_CREAT|O_TRUNC, 0600)) < 0)
+    {
+        fprintf(stderr, "Error: Unable to open %s: %s\n", spill_path, strerror(errno));
+        exit(-1);
+    }
+
+    init_shared(s, producers, consumers, compact, overflow, timeout_ms, combining,
+                lock, spill_fd, iterations);
 
-    create_producer(s, count, prod_interval);
-    create_producer(s, count, prod_interval);
-    create_consumer(s, count, con_interval);
-    create_consumer(s, count, con_interval);
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-    /* This line should never be reached */
-    return -1;
+    for (i = 0; i < producers; i++)
+        create_producer(s, i, count, prod_interval);
+    for (i = 0; i < consumers; i++)
+        create_consumer(s, producers + i, con_interval, drain);
+
+    /* With -k the children run each time everyone reaches the barrier,
+       and wait at it again when done; in between the queues are reset
+       here. A child that dies part way leaves the rest waiting. */
+    if (iterations > 1)
+    {
+        /* the first barrier only opens once every child has started,
+           so startup ends here and no run includes it */
+        iteration_wait(s);
+        fprintf(stderr, "Startup (mmap, init, fork, children ready): %.1f us\n",
+                (now_ns() - setup_ns) / 1e3);
+    }
+
+    for (k = 0; iterations > 1 && k < iterations; k++)
+    {
+        if (k > 0)
+            reset_queues(s, producers);
+
+        /* the children may get going before we wake up, so the clock
+           starts before the barrier and counts waking them all */
+        run_ns = now_ns();
+        iteration_wait(s);
+        iteration_wait(s);
+        report_iteration(s, k, run_ns, now_ns());
+        if (check_counts(s))
+            bad = 1;
+    }
+
+    failed = reap_children(producers + consumers);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    /* with -k the queue was reset before each run, so what follows is
+       only about the last one */
+    if (iterations == 1)
+        report_throughput(s, producers, consumers, elapsed_seconds(&start, &end));
+    queue_report_wakeups(wakeup_stats(s));
+    if (combining)
+        queue_report_combining(combining_stats(s));
+    qlock_report(queue_lock(s), producers + consumers);
+    if (overflow == QUEUE_SPILL)
+        queue_report_spill(spill_stats(s));
+    if (overflow != QUEUE_BLOCK)
+        queue_report_overflow(overflow_stats(s));
+
+    if (failed)
+    {
+        fprintf(stderr, "Error: %d child process(es) did not exit cleanly\n", failed);
+        return -1;
+    }
+    /* with -k every run was checked as it finished */
+    if (bad || (iterations == 1 && check_counts(s)))
+        return -1;
+
+    return 0;
 }
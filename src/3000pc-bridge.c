@@ -0,0 +1,666 @@
+/* 3000pc-bridge.c  Producer-consumer across two rings joined by a TCP bridge
+ * Copyright (C) 2020  William Findlay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+/* You really shouldn't be incorporating parts of this in any other code,
+   it is meant for teaching, not production */
+
+/* Producers push words into a local ring in shared memory. A sender
+ * process drains that ring in batches and writes each batch to a TCP
+ * connection with one writev(). On the other end a receiver process reads
+ * the batches and pushes them into a second ring, which the consumers
+ * pop from:
+ *
+ *   producers -> local ring -> sender ==TCP==> receiver -> remote ring -> consumers
+ *
+ * Flow control is by credit. The sender starts with -w credits, one per
+ * message, and spends them as it sends. The receiver grants a batch's
+ * credits back only once it has pushed that batch into the remote ring.
+ * So a backed up remote ring stops the grants, the sender stops
+ * draining, the local ring fills, and the producers block, the same as
+ * if they shared one ring. Nothing queues up without bound in between.
+ *
+ * -n picks how the sender uses TCP: nodelay sets TCP_NODELAY so every
+ * batch goes out at once; cork sets TCP_CORK and only uncorks when the
+ * local ring has nothing more ready, so back to back batches share
+ * segments; default leaves Nagle's algorithm alone.
+ *
+ * -R both (the default) runs both ends over loopback and reports
+ * throughput, end to end latency, and the time batches spend crossing
+ * the bridge. To run across hosts, start -R remote -P <port> on one and
+ * -R local -r <host> -P <port> on the other; each reports its own side
+ * (latency needs one clock, so only -R both reports it). */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "words.h"
+#include "transport.h"
+
+#define QUEUESIZE 32
+
+#define QUEUE_NAME     localq
+#define QUEUE_TYPE     message
+#define QUEUE_CAPACITY QUEUESIZE
+#define QUEUE_POLICY   QUEUE_MPSC
+#include "queue.h"
+
+#define QUEUE_NAME     remoteq
+#define QUEUE_TYPE     message
+#define QUEUE_CAPACITY QUEUESIZE
+#define QUEUE_POLICY   QUEUE_MPMC
+#include "queue.h"
+
+/* Most messages in one batch on the wire */
+#define BRIDGE_BATCHMAX 256
+#define DEFAULT_BATCH   64
+#define DEFAULT_WINDOW  256
+
+#define ROLE_BOTH   0
+#define ROLE_LOCAL  1           /* producers and sender */
+#define ROLE_REMOTE 2           /* receiver and consumers */
+
+#define DELAY_DEFAULT 0
+#define DELAY_NODELAY 1
+#define DELAY_CORK    2
+
+/* Sent before every batch; a count of 0 ends the stream */
+typedef struct batch_header {
+        uint32_t count;
+        uint32_t pad;
+        int64_t sent_ns;        /* when the sender wrote it */
+} batch_header;
+
+typedef struct shared {
+        localq local;
+        remoteq remote;
+        int producers_left;
+        int prod_count;
+        int con_count;
+        long latency_total_ns;
+        long latency_max_ns;
+        long hop_total_ns;      /* sender to receiver, summed per message */
+        long bytes;
+        long writes;
+        long credit_waits;      /* times the sender ran out of credit */
+} shared;
+
+void usage_exit(char *progname)
+{
+        fprintf(stderr,
+                "Usage: %s [-R both|local|remote] [-r host] [-P port] [-p producers] "
+                "[-c consumers] [-b batch] [-w window] [-n default|nodelay|cork] "
+                "<event count> <prod interval int> <con interval int>\n"
+                "  <event count> is the number of words each producer sends\n"
+                "  -R picks which end(s) of the bridge to run; both runs them over loopback\n"
+                "  -r and -P give the remote end's address (default 127.0.0.1, any free port)\n"
+                "  -b sends up to batch words per writev (at most %d)\n"
+                "  -w is how many words may be in flight across the bridge\n"
+                "  -n sets TCP_NODELAY, or corks until the local ring runs dry\n",
+                progname, BRIDGE_BATCHMAX);
+        exit(-1);
+}
+
+int parse_delay(const char *arg)
+{
+        if (strcmp(arg, "default") == 0)
+                return DELAY_DEFAULT;
+        if (strcmp(arg, "nodelay") == 0)
+                return DELAY_NODELAY;
+        if (strcmp(arg, "cork") == 0)
+                return DELAY_CORK;
+        return -1;
+}
+
+int parse_role(const char *arg)
+{
+        if (strcmp(arg, "both") == 0)
+                return ROLE_BOTH;
+        if (strcmp(arg, "local") == 0)
+                return ROLE_LOCAL;
+        if (strcmp(arg, "remote") == 0)
+                return ROLE_REMOTE;
+        return -1;
+}
+
+/* Read exactly len bytes; returns 0 on end of file, -1 on error */
+ssize_t read_full(int fd, void *buf, size_t len)
+{
+        size_t got = 0;
+        ssize_t n;
+
+        while (got < len)
+        {
+                n = read(fd, (char *) buf + got, len - got);
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n <= 0)
+                        return n;
+                got += n;
+        }
+
+        return got;
+}
+
+/* writev() everything in iov, picking up after short writes */
+int writev_full(int fd, struct iovec *iov, int iovcnt)
+{
+        ssize_t n;
+
+        while (iovcnt > 0)
+        {
+                n = writev(fd, iov, iovcnt);
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n < 0)
+                        return -1;
+                while (iovcnt > 0 && (size_t) n >= iov->iov_len)
+                {
+                        n -= iov->iov_len;
+                        iov++;
+                        iovcnt--;
+                }
+                if (iovcnt > 0)
+                {
+                        iov->iov_base = (char *) iov->iov_base + n;
+                        iov->iov_len -= n;
+                }
+        }
+
+        return 0;
+}
+
+void set_cork(int sock, int on)
+{
+        setsockopt(sock, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+/* Adds up the credit grants already waiting on sock, or if wait is set
+ * and there are none, blocks for the next one. Returns the credit, or -1
+ * if the receiver has gone away. */
+int take_credit(int sock, int wait)
+{
+        uint32_t grants[64];
+        int avail = 0, i, credit = 0;
+
+        if (ioctl(sock, FIONREAD, &avail) == -1)
+                return -1;
+
+        /* only whole grants, and no more than we have room for */
+        avail -= avail % sizeof(uint32_t);
+        if (avail > (int) sizeof(grants))
+                avail = sizeof(grants);
+        if (avail == 0 && !wait)
+                return 0;
+        if (avail == 0)
+                avail = sizeof(uint32_t);
+
+        if (read_full(sock, grants, avail) != avail)
+                return -1;
+        for (i = 0; i < avail / (int) sizeof(uint32_t); i++)
+                credit += grants[i];
+
+        return credit;
+}
+
+void producer(shared *s, int event_count, int prod_interval, unsigned int seed)
+{
+        message m;
+        int i;
+
+        srandom(seed);
+
+        for (i=0; i < event_count; i++)
+        {
+                pick_random_word(m.word);
+                m.sent_ns = now_ns();
+                localq_push(&s->local, &m);
+                __atomic_add_fetch(&s->prod_count, 1, __ATOMIC_RELAXED);
+
+                /* Don't sleep if interval <= 0 */
+                if (prod_interval <= 0)
+                        continue;
+                /* Sleep if we hit our interval */
+                if (i % prod_interval == 0)
+                {
+                        fprintf(stderr, "Producer sleeping for 1 second...\n");
+                        sleep(1);
+                }
+        }
+
+        /* The last producer closes the local ring, which ends the stream */
+        if (__atomic_sub_fetch(&s->producers_left, 1, __ATOMIC_ACQ_REL) == 0)
+                localq_close(&s->local);
+        fprintf(stderr, "Producer finished.\n");
+        exit(0);
+}
+
+void sender(shared *s, int sock, int batch, int delay, int window)
+{
+        message msgs[BRIDGE_BATCHMAX];
+        struct iovec iov[2];
+        batch_header h;
+        int n, max, got, credit = window;
+
+        memset(&h, 0, sizeof(h));
+        if (delay == DELAY_CORK)
+                set_cork(sock, 1);
+
+        for (;;)
+        {
+                /* Nothing more can go until the receiver answers, so
+                   don't leave anything sitting in the cork */
+                if (delay == DELAY_CORK && credit == 0)
+                {
+                        set_cork(sock, 0);
+                        set_cork(sock, 1);
+                }
+
+                /* Pick up credit as it comes in, but only wait for it
+                   once we have none left */
+                if ((got = take_credit(sock, credit == 0)) < 0)
+                {
+                        report_error("Receiver went away");
+                        exit(-1);
+                }
+                if (credit == 0)
+                        s->credit_waits++;
+                credit += got;
+                if (credit == 0)
+                        continue;
+
+                max = batch < credit ? batch : credit;
+                if ((n = localq_drain(&s->local, msgs, max)) < 0)
+                        break;
+                /* the ring is smaller than a batch, so top up with
+                   whatever producers have added since */
+                while (n < max && localq_try_pop(&s->local, &msgs[n]) == 0)
+                        n++;
+
+                h.count = n;
+                h.sent_ns = now_ns();
+                iov[0].iov_base = &h;
+                iov[0].iov_len = sizeof(h);
+                iov[1].iov_base = msgs;
+                iov[1].iov_len = n * sizeof(message);
+                if (writev_full(sock, iov, 2) == -1)
+                {
+                        fprintf(stderr, "Error: Unable to send batch: %s\n", strerror(errno));
+                        exit(-1);
+                }
+
+                credit -= n;
+                s->writes++;
+                s->bytes += sizeof(h) + n * sizeof(message);
+
+                /* The ring has run dry for now, so push out what's corked */
+                if (delay == DELAY_CORK && n < max)
+                {
+                        set_cork(sock, 0);
+                        set_cork(sock, 1);
+                }
+        }
+
+        /* An empty batch tells the receiver we're done */
+        h.count = 0;
+        iov[0].iov_base = &h;
+        iov[0].iov_len = sizeof(h);
+        if (writev_full(sock, iov, 1) == -1)
+                fprintf(stderr, "Error: Unable to end stream: %s\n", strerror(errno));
+        if (delay == DELAY_CORK)
+                set_cork(sock, 0);
+        shutdown(sock, SHUT_WR);
+
+        /* Grants for the last batches are still on their way; wait for
+           the receiver to hang up rather than close on them */
+        while (take_credit(sock, 1) > 0)
+                ;
+
+        fprintf(stderr, "Sender finished.\n");
+        exit(0);
+}
+
+void receiver(shared *s, int sock)
+{
+        message msgs[BRIDGE_BATCHMAX];
+        batch_header h;
+        uint32_t grant;
+        long arrived;
+        int k;
+
+        for (;;)
+        {
+                if (read_full(sock, &h, sizeof(h)) != sizeof(h) || h.count == 0)
+                        break;
+                if (h.count > BRIDGE_BATCHMAX ||
+                    read_full(sock, msgs, h.count * sizeof(message)) != (ssize_t) (h.count * sizeof(message)))
+                {
+                        report_error("Bad batch from sender");
+                        exit(-1);
+                }
+
+                arrived = now_ns();
+                s->hop_total_ns += (arrived - h.sent_ns) * h.count;
+
+                /* Blocks while the remote ring is full, holding back the
+                   grant and so, in the end, the producers */
+                for (k = 0; k < (int) h.count; k++)
+                        remoteq_push(&s->remote, &msgs[k]);
+
+                grant = h.count;
+                if (send(sock, &grant, sizeof(grant), MSG_NOSIGNAL) != sizeof(grant))
+                {
+                        fprintf(stderr, "Error: Unable to grant credit: %s\n", strerror(errno));
+                        exit(-1);
+                }
+        }
+
+        remoteq_close(&s->remote);
+        fprintf(stderr, "Receiver finished.\n");
+        exit(0);
+}
+
+void consumer(shared *s, int con_interval)
+{
+        long latency, total = 0, max = 0;
+        message m;
+        int i;
+
+        /* Keep consuming until the receiver closes the remote ring */
+        for (i=0; remoteq_pop(&s->remote, &m) == 0; i++)
+        {
+                latency = now_ns() - m.sent_ns;
+                total += latency;
+                if (latency > max)
+                        max = latency;
+
+                output_word(i, m.word);
+
+                /* Don't sleep if interval <= 0 */
+                if (con_interval <= 0)
+                        continue;
+                /* Sleep if we hit our interval */
+                if (i % con_interval == 0)
+                {
+                        fprintf(stderr, "Consumer sleeping for 1 second...\n");
+                        sleep(1);
+                }
+        }
+
+        __atomic_add_fetch(&s->con_count, i, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&s->latency_total_ns, total, __ATOMIC_RELAXED);
+        /* keep the largest of every consumer's max */
+        latency = __atomic_load_n(&s->latency_max_ns, __ATOMIC_RELAXED);
+        while (max > latency &&
+               !__atomic_compare_exchange_n(&s->latency_max_ns, &latency, max, 0,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                ;
+
+        fprintf(stderr, "Consumer finished.\n");
+        exit(0);
+}
+
+/* Listen on host:port (port 0 picks a free one, stored back in *port) */
+int listen_on(const char *host, int *port)
+{
+        struct sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        int sock, on = 1;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(*port);
+        addr.sin_addr.s_addr = host ? inet_addr(host) : htonl(INADDR_ANY);
+
+        if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+            setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+            bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+            listen(sock, 1) < 0 ||
+            getsockname(sock, (struct sockaddr *) &addr, &len) < 0)
+        {
+                fprintf(stderr, "Error: Unable to listen on port %d: %s\n", *port, strerror(errno));
+                exit(-1);
+        }
+
+        *port = ntohs(addr.sin_port);
+        return sock;
+}
+
+int connect_to(const char *host, int port)
+{
+        struct addrinfo hints, *res;
+        char service[16];
+        int sock, err;
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        snprintf(service, sizeof(service), "%d", port);
+
+        if ((err = getaddrinfo(host, service, &hints, &res)) != 0)
+        {
+                fprintf(stderr, "Error: Unable to resolve %s: %s\n", host, gai_strerror(err));
+                exit(-1);
+        }
+
+        if ((sock = socket(res->ai_family, res->ai_socktype, 0)) < 0 ||
+            connect(sock, res->ai_addr, res->ai_addrlen) < 0)
+        {
+                fprintf(stderr, "Error: Unable to connect to %s:%d: %s\n", host, port, strerror(errno));
+                exit(-1);
+        }
+
+        freeaddrinfo(res);
+        return sock;
+}
+
+int accept_one(int listener)
+{
+        int sock;
+
+        while ((sock = accept(listener, NULL, NULL)) < 0 && errno == EINTR)
+                ;
+        if (sock < 0)
+        {
+                fprintf(stderr, "Error: Unable to accept: %s\n", strerror(errno));
+                exit(-1);
+        }
+
+        close(listener);
+        return sock;
+}
+
+int main(int argc, char *argv[])
+{
+        int count, prod_interval, con_interval;
+        int producers = 1, consumers = 1, batch = DEFAULT_BATCH, window = DEFAULT_WINDOW;
+        int role = ROLE_BOTH, delay = DELAY_DEFAULT, port = 0;
+        int i, opt, on = 1, children = 0, failed, listener = -1, sock = -1;
+        const char *host = "127.0.0.1";
+        struct timespec start, end;
+        double secs;
+        shared *s;
+
+        while ((opt = getopt(argc, argv, "R:r:P:p:c:b:w:n:")) != -1)
+        {
+                switch (opt)
+                {
+                        case 'R':
+                                if ((role = parse_role(optarg)) < 0)
+                                        usage_exit(argv[0]);
+                                break;
+                        case 'r':
+                                host = optarg;
+                                break;
+                        case 'P':
+                                port = atoi(optarg);
+                                break;
+                        case 'p':
+                                producers = atoi(optarg);
+                                break;
+                        case 'c':
+                                consumers = atoi(optarg);
+                                break;
+                        case 'b':
+                                batch = atoi(optarg);
+                                break;
+                        case 'w':
+                                window = atoi(optarg);
+                                break;
+                        case 'n':
+                                if ((delay = parse_delay(optarg)) < 0)
+                                        usage_exit(argv[0]);
+                                break;
+                        default:
+                                usage_exit(argv[0]);
+                }
+        }
+
+        if (producers < 1 || consumers < 1 || batch < 1 || batch > BRIDGE_BATCHMAX || window < 1)
+        {
+                report_error("Bad producer, consumer, batch or window size");
+                usage_exit(argv[0]);
+        }
+
+        if (role == ROLE_LOCAL && port == 0)
+        {
+                report_error("-R local needs the remote end's port");
+                usage_exit(argv[0]);
+        }
+
+        if (argc - optind < 3)
+        {
+                report_error("Not enough arguments");
+                usage_exit(argv[0]);
+        }
+
+        count = atoi(argv[optind]);
+        prod_interval = atoi(argv[optind + 1]);
+        con_interval = atoi(argv[optind + 2]);
+
+        s = (shared *) mmap(NULL, sizeof(shared),
+                            PROT_READ|PROT_WRITE,
+                            MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+
+        if (s == MAP_FAILED)
+        {
+                fprintf(stderr, "Error: Unable to mmap: %s\n", strerror(errno));
+                exit(-1);
+        }
+
+        localq_init(&s->local);
+        remoteq_init(&s->remote);
+        s->producers_left = producers;
+
+        /* Listen before anything is forked so the sender can't beat us */
+        if (role != ROLE_LOCAL)
+        {
+                listener = listen_on(role == ROLE_BOTH ? host : NULL, &port);
+                if (role == ROLE_REMOTE)
+                        fprintf(stderr, "Listening on port %d\n", port);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        if (role != ROLE_LOCAL)
+        {
+                if (fork_or_die() == 0)
+                        receiver(s, accept_one(listener));
+                close(listener);
+
+                for (i = 0; i < consumers; i++)
+                {
+                        if (fork_or_die() == 0)
+                                consumer(s, con_interval);
+                }
+                children += 1 + consumers;
+        }
+
+        if (role != ROLE_REMOTE)
+        {
+                sock = connect_to(host, port);
+                if (delay == DELAY_NODELAY)
+                        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+                if (fork_or_die() == 0)
+                        sender(s, sock, batch, delay, window);
+                close(sock);
+
+                for (i = 0; i < producers; i++)
+                {
+                        if (fork_or_die() == 0)
+                                producer(s, count, prod_interval, getpid());
+                }
+                children += 1 + producers;
+        }
+
+        failed = reap_children(children);
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        secs = elapsed_seconds(&start, &end);
+
+        if (role != ROLE_REMOTE)
+        {
+                fprintf(stderr, "Sent: %d produced in %.3f s (%.0f words/s)\n",
+                        s->prod_count, secs, secs > 0 ? s->prod_count / secs : 0.0);
+                fprintf(stderr, "Bridge: %ld bytes in %ld writev(s) (%.1f words each, %.1f MB/s), "
+                        "out of credit %ld times\n",
+                        s->bytes, s->writes,
+                        s->writes ? (double) s->local.con_count / s->writes : 0.0,
+                        secs > 0 ? s->bytes / secs / 1e6 : 0.0, s->credit_waits);
+        }
+        if (role != ROLE_LOCAL)
+                fprintf(stderr, "Received: %d consumed in %.3f s (%.0f words/s)\n",
+                        s->con_count, secs, secs > 0 ? s->con_count / secs : 0.0);
+        if (role == ROLE_BOTH)
+        {
+                fprintf(stderr, "Latency: %.1f us mean end to end (%.1f us max), "
+                        "%.1f us mean across the bridge\n",
+                        s->con_count ? s->latency_total_ns / 1e3 / s->con_count : 0.0,
+                        s->latency_max_ns / 1e3,
+                        s->con_count ? s->hop_total_ns / 1e3 / s->con_count : 0.0);
+        }
+
+        if (failed)
+        {
+                fprintf(stderr, "Error: %d child process(es) did not exit cleanly\n", failed);
+                return -1;
+        }
+        if (role == ROLE_BOTH && s->con_count != s->prod_count)
+        {
+                fprintf(stderr, "Error: %d words produced but %d consumed\n",
+                        s->prod_count, s->con_count);
+                return -1;
+        }
+
+        return 0;
+}
@@ -0,0 +1,190 @@
+/* 3000pc-broadcast.c  Producer with many subscribers using a broadcast ring in mmap shared memory
+ * Copyright (C) 2020  William Findlay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+/* You really shouldn't be incorporating parts of this in any other code,
+   it is meant for teaching, not production */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "words.h"
+#include "proc.h"
+
+#define QUEUESIZE 32
+#define MAX_SUBSCRIBERS 64
+
+#define BCAST_NAME     wordcast
+#define BCAST_TYPE     word_t
+#define BCAST_CAPACITY QUEUESIZE
+#include "broadcast.h"
+
+typedef struct shared {
+        wordcast ring;
+        int prod_count;
+        bcast_reader results[MAX_SUBSCRIBERS];  /* filled in as subscribers exit */
+} shared;
+
+void usage_exit(char *progname)
+{
+        fprintf(stderr,
+                "Usage: %s [-s subscribers] <event count> <prod interval int> <con interval int>\n",
+                progname);
+        exit(-1);
+}
+
+void producer(shared *s, int event_count, int prod_interval)
+{
+        word_t word;
+        int i;
+
+        for (i=0; i < event_count; i++)
+        {
+                pick_word(word);
+                wordcast_publish(&s->ring, &word);
+                s->prod_count++;
+
+                /* Don't sleep if interval <= 0 */
+                if (prod_interval <= 0)
+                        continue;
+                /* Sleep if we hit our interval */
+                if (i % prod_interval == 0)
+                {
+                        fprintf(stderr, "Producer sleeping for 1 second...\n");
+                        sleep(1);
+                }
+        }
+
+        wordcast_close(&s->ring);
+        fprintf(stderr, "Producer finished.\n");
+}
+
+void subscriber(shared *s, int id, bcast_reader *r, int con_interval)
+{
+        word_t word;
+        int i;
+
+        for (i=0; wordcast_read(&s->ring, r, &word) == 0; i++)
+        {
+                printf("Subscriber %d word %lu: %s\n", id, r->next, word);
+
+                /* Don't sleep if interval <= 0 */
+                if (con_interval <= 0)
+                        continue;
+                /* Sleep if we hit our interval */
+                if (i % con_interval == 0)
+                {
+                        fprintf(stderr, "Subscriber %d sleeping for 1 second...\n", id);
+                        sleep(1);
+                }
+        }
+
+        s->results[id] = *r;
+        fprintf(stderr, "Subscriber %d finished.\n", id);
+        exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+        int count, prod_interval, con_interval;
+        int subscribers = 2, i, opt, failed;
+        struct timespec start, end;
+        bcast_reader r;
+        double secs;
+
+        shared *s;
+
+        while ((opt = getopt(argc, argv, "s:")) != -1)
+        {
+                switch (opt)
+                {
+                        case 's':
+                                subscribers = atoi(optarg);
+                                break;
+                        default:
+                                usage_exit(argv[0]);
+                }
+        }
+
+        if (subscribers < 1 || subscribers > MAX_SUBSCRIBERS)
+        {
+                fprintf(stderr, "Error: Need between 1 and %d subscribers\n", MAX_SUBSCRIBERS);
+                usage_exit(argv[0]);
+        }
+
+        if (argc - optind < 3)
+        {
+                report_error("Not enough arguments");
+                usage_exit(argv[0]);
+        }
+
+        count = atoi(argv[optind]);
+        prod_interval = atoi(argv[optind + 1]);
+        con_interval = atoi(argv[optind + 2]);
+
+        s = (shared *) mmap(NULL, sizeof(shared),
+                             PROT_READ|PROT_WRITE,
+                             MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+
+        if (s == MAP_FAILED)
+        {
+                fprintf(stderr, "Error: Unable to mmap: %s\n", strerror(errno));
+                exit(-1);
+        }
+
+        wordcast_init(&s->ring);
+        s->prod_count = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for (i = 0; i < subscribers; i++)
+        {
+                /* Subscribe before the producer starts so nobody misses
+                   the first words; the child gets its own copy of r */
+                wordcast_subscribe(&s->ring, &r);
+
+                if (fork_or_die() == 0)
+                        subscriber(s, i, &r, con_interval);
+        }
+
+        /* Producer */
+        producer(s, count, prod_interval);
+
+        failed = reap_children(subscribers);
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        secs = elapsed_seconds(&start, &end);
+
+        fprintf(stderr, "1 producer x %d subscriber(s): %d published in %.3f s (%.0f words/s)\n",
+                subscribers, s->prod_count, secs, secs > 0 ? s->prod_count / secs : 0.0);
+        for (i = 0; i < subscribers; i++)
+                fprintf(stderr, "Subscriber %d: %lu received, %lu lost to overruns\n",
+                        i, s->results[i].received, s->results[i].lost);
+
+        if (failed)
+        {
+                fprintf(stderr, "Error: %d subscriber(s) did not exit cleanly\n", failed);
+                return -1;
+        }
+
+        return 0;
+}
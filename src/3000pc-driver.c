@@ -0,0 +1,492 @@
+/* 3000pc-driver.c  One producer-consumer driver for every transport
+ * Copyright (C) 2020  William Findlay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+/* You really shouldn't be incorporating parts of this in any other code,
+   it is meant for teaching, not production */
+
+/* The other 3000pc programs each have their own producer, consumer and
+ * main() around one way of moving words. This one has a single producer,
+ * consumer and main(), and moves words with whichever transport is picked
+ * with --transport, so they can all be compared under the same load,
+ * CPU placement and measurement. See transport.h. */
+
+#define _GNU_SOURCE             /* pipe2, sendmmsg, recvmmsg, sched_setaffinity */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "words.h"
+#include "histogram.h"
+#include "perf.h"
+#include "trace.h"
+#include "transport.h"
+#include "transport-pipe.h"
+#include "transport-socket.h"
+
+#define SHM_TRANSPORT_NAME   shm_cond
+#define SHM_TRANSPORT_LABEL  "shm-cond"
+#define SHM_TRANSPORT_POLICY QUEUE_SPSC
+#include "transport-shm.h"
+
+#define SHM_TRANSPORT_NAME   shm_single_mutex
+#define SHM_TRANSPORT_LABEL  "shm-single-mutex"
+#define SHM_TRANSPORT_POLICY QUEUE_MPSC
+#include "transport-shm.h"
+
+#define SHM_TRANSPORT_NAME   shm_mpmc
+#define SHM_TRANSPORT_LABEL  "shm-mpmc"
+#define SHM_TRANSPORT_POLICY QUEUE_MPMC
+#include "transport-shm.h"
+
+static const transport_ops *transports[] = {
+        &pipe_ops,
+        &pipe_packet_ops,
+        &socket_ops,
+        &shm_cond_ops,
+        &shm_single_mutex_ops,
+        &shm_mpmc_ops,
+        NULL
+};
+
+/* Counters shared by every process, in an anonymous shared mapping */
+typedef struct stats {
+        int prod_count;
+        int con_count;
+        long latency_total_ns;
+        long latency_max_ns;
+        perf_totals prod_perf;
+        perf_totals con_perf;
+        word_histogram produced;
+        word_histogram consumed;
+} stats;
+
+static struct option long_options[] = {
+        {"transport", required_argument, NULL, 't'},
+        {"list",      no_argument,       NULL, 'l'},
+        {NULL, 0, NULL, 0}
+};
+
+void usage_exit(char *progname)
+{
+        fprintf(stderr,
+                "Usage: %s --transport=<name> [-p producers] [-c consumers] [-b batch] "
+                "[-s buffer size] [-a] [-e] [-H] [-T trace file] "
+                "<event count> <prod interval int> <con interval int>\n"
+                "  <event count> is the number of words each producer sends\n"
+                "  -b sends and receives up to batch words at a time (at most %d)\n"
+                "  -s sets the pipe or socket buffer size\n"
+                "  -a pins each process to its own CPU, producers first\n"
+                "  -e counts cycles, cache misses, context switches etc. per message\n"
+                "  -H counts words per wordlist entry instead of printing them, and\n"
+                "     checks the consumers' counts against the producers'\n"
+                "  -T writes an event trace (needs a build with -DTRACE, see trace.h)\n"
+                "  --list shows the available transports\n",
+                progname, TRANSPORT_BATCHMAX);
+        exit(-1);
+}
+
+void list_transports(void)
+{
+        int i;
+
+        for (i = 0; transports[i]; i++)
+                fprintf(stderr, "  %-18s %s\n", transports[i]->name, transports[i]->description);
+        /* no scan is longer than the ring, and short ones are never vectorised */
+        fprintf(stderr, "Shared memory batches are scanned with the %s slot scan\n",
+                TRANSPORT_QUEUESIZE < SIMD_MIN_LEN ? "scalar" : simd_name());
+}
+
+const transport_ops *find_transport(const char *name)
+{
+        int i;
+
+        for (i = 0; transports[i]; i++)
+        {
+                if (strcmp(transports[i]->name, name) == 0)
+                        return transports[i];
+        }
+
+        return NULL;
+}
+
+/* Pin process number k to a CPU, wrapping around if there are more
+   processes than CPUs */
+void pin_to_cpu(int k)
+{
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(k % (cpus > 0 ? cpus : 1), &set);
+        if (sched_setaffinity(0, sizeof(set), &set) == -1)
+                fprintf(stderr, "Error: Unable to set CPU affinity: %s\n", strerror(errno));
+}
+
+/* Send n messages, in one go if the transport can. Returns the number sent. */
+int queue_words(transport *t, message *m, int n)
+{
+        int k, sent = 0;
+
+        if (n > 1 && t->ops->send_batch)
+                return t->ops->send_batch(t, m, n);
+
+        for (k = 0; k < n; k++)
+        {
+                if (t->ops->send(t, &m[k]) != 1)
+                        break;
+                sent++;
+        }
+
+        return sent;
+}
+
+int get_next_words(transport *t, message *m, int max)
+{
+        if (max > 1 && t->ops->recv_batch)
+                return t->ops->recv_batch(t, m, max);
+
+        return t->ops->recv(t, m);
+}
+
+void producer(transport *t, int event_count, int prod_interval,
+              int batch, unsigned int seed, stats *st, int counters, int aggregate)
+{
+        message msgs[TRANSPORT_BATCHMAX];
+        int i, k, n = 0, sent;
+        word_histogram hist;
+        perf_counters pc;
+
+        memset(&hist, 0, sizeof(hist));
+
+        srandom(seed);
+
+        if (counters)
+        {
+                perf_open(&pc);
+                perf_start(&pc);
+        }
+
+        for (i=0; i < event_count; i++)
+        {
+                pick_random_word(msgs[n++].word);
+                if (n == batch || i == event_count - 1)
+                {
+                        for (k = 0; k < n; k++)
+                                msgs[k].sent_ns = now_ns();
+                        sent = queue_words(t, msgs, n);
+                        TRACE_EVENT(TRACE_SEND, sent);
+                        for (k = 0; aggregate && k < sent; k++)
+                                histogram_count(&hist, msgs[k].word);
+                        if (sent > 0)
+                                __atomic_add_fetch(&st->prod_count, sent, __ATOMIC_RELAXED);
+                        n = 0;
+                }
+
+                /* Don't sleep if interval <= 0 */
+                if (prod_interval <= 0)
+                        continue;
+                /* Sleep if we hit our interval */
+                if (i % prod_interval == 0)
+                {
+                        fprintf(stderr, "Producer sleeping for 1 second...\n");
+                        sleep(1);
+                }
+        }
+
+        if (counters)
+        {
+                perf_stop(&pc);
+                perf_add(&pc, &st->prod_perf);
+        }
+
+        if (aggregate)
+                histogram_merge(&st->produced, &hist);
+
+        t->ops->close(t, TRANSPORT_PRODUCER);
+        fprintf(stderr, "Producer finished.\n");
+        exit(0);
+}
+
+void consumer(transport *t, int con_interval, int batch, stats *st, int counters, int aggregate)
+{
+        message msgs[TRANSPORT_BATCHMAX];
+        long latency, total = 0, max = 0;
+        word_histogram hist;
+        perf_counters pc;
+        int i, k, n;
+
+        memset(&hist, 0, sizeof(hist));
+
+        if (counters)
+        {
+                perf_open(&pc);
+                perf_start(&pc);
+        }
+
+        /* Keep receiving until every producer has closed its end */
+        for (i=0; (n = get_next_words(t, msgs, batch)) > 0; )
+        {
+                TRACE_EVENT(TRACE_RECV, n);
+                for (k=0; k < n; k++, i++)
+                {
+                        latency = now_ns() - msgs[k].sent_ns;
+                        total += latency;
+                        if (latency > max)
+                                max = latency;
+
+                        /* With -H this is the whole per-word cost; no printf */
+                        if (aggregate)
+                                histogram_count(&hist, msgs[k].word);
+                        else
+                                output_word(i, msgs[k].word);
+
+                        /* Don't sleep if interval <= 0 */
+                        if (con_interval <= 0)
+                                continue;
+                        /* Sleep if we hit our interval */
+                        if (i % con_interval == 0)
+                        {
+                                fprintf(stderr, "Consumer sleeping for 1 second...\n");
+                                sleep(1);
+                        }
+                }
+        }
+
+        if (counters)
+        {
+                perf_stop(&pc);
+                perf_add(&pc, &st->con_perf);
+        }
+
+        if (aggregate)
+                histogram_merge(&st->consumed, &hist);
+
+        __atomic_add_fetch(&st->con_count, i, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&st->latency_total_ns, total, __ATOMIC_RELAXED);
+        /* keep the largest of every consumer's max */
+        latency = __atomic_load_n(&st->latency_max_ns, __ATOMIC_RELAXED);
+        while (max > latency &&
+               !__atomic_compare_exchange_n(&st->latency_max_ns, &latency, max, 0,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                ;
+
+        t->ops->close(t, TRANSPORT_CONSUMER);
+        fprintf(stderr, "Consumer finished.\n");
+        exit(n < 0 ? -1 : 0);
+}
+
+int main(int argc, char *argv[])
+{
+        int pid, count, prod_interval, con_interval;
+        int producers = 1, consumers = 1, batch = 1, pin = 0, counters = 0, aggregate = 0;
+        int i, opt, failed;
+        const transport_ops *ops = NULL;
+        char *trace_file = NULL;
+        struct timespec start, end;
+        transport t;
+        double secs;
+        stats *st;
+
+        memset(&t, 0, sizeof(t));
+
+        while ((opt = getopt_long(argc, argv, "t:lp:c:b:s:aeHT:", long_options, NULL)) != -1)
+        {
+                switch (opt)
+                {
+                        case 't':
+                                ops = find_transport(optarg);
+                                if (!ops)
+                                {
+                                        fprintf(stderr, "Error: Unknown transport %s, pick one of:\n", optarg);
+                                        list_transports();
+                                        exit(-1);
+                                }
+                                break;
+                        case 'l':
+                                list_transports();
+                                exit(0);
+                        case 'p':
+                                producers = atoi(optarg);
+                                break;
+                        case 'c':
+                                consumers = atoi(optarg);
+                                break;
+                        case 'b':
+                                batch = atoi(optarg);
+                                break;
+                        case 's':
+                                t.buffer_size = atoi(optarg);
+                                break;
+                        case 'a':
+                                pin = 1;
+                                break;
+                        case 'e':
+                                counters = 1;
+                                break;
+                        case 'H':
+                                aggregate = 1;
+                                break;
+                        case 'T':
+                                trace_file = optarg;
+                                break;
+                        default:
+                                usage_exit(argv[0]);
+                }
+        }
+
+        if (!ops)
+        {
+                report_error("No transport given");
+                usage_exit(argv[0]);
+        }
+
+        if (producers < 1 || consumers < 1 || batch < 1 || batch > TRANSPORT_BATCHMAX)
+        {
+                report_error("Bad producer, consumer or batch count");
+                usage_exit(argv[0]);
+        }
+
+        if (ops->max_producers && producers > ops->max_producers)
+        {
+                fprintf(stderr, "Error: %s takes at most %d producer(s)\n",
+                        ops->name, ops->max_producers);
+                exit(-1);
+        }
+        if (ops->max_consumers && consumers > ops->max_consumers)
+        {
+                fprintf(stderr, "Error: %s takes at most %d consumer(s)\n",
+                        ops->name, ops->max_consumers);
+                exit(-1);
+        }
+
+        if (argc - optind < 3)
+        {
+                report_error("Not enough arguments");
+                usage_exit(argv[0]);
+        }
+
+        count = atoi(argv[optind]);
+        prod_interval = atoi(argv[optind + 1]);
+        con_interval = atoi(argv[optind + 2]);
+
+        st = (stats *) mmap(NULL, sizeof(stats),
+                            PROT_READ|PROT_WRITE,
+                            MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+
+        if (st == MAP_FAILED)
+        {
+                fprintf(stderr, "Error: Unable to mmap: %s\n", strerror(errno));
+                exit(-1);
+        }
+
+#ifndef TRACE
+        if (trace_file)
+                fprintf(stderr, "Warning: Built without -DTRACE, not writing %s\n", trace_file);
+#endif
+        if (aggregate)
+                histogram_init();
+
+        if (trace_file && trace_init(producers + consumers))
+                exit(-1);
+
+        t.ops = ops;
+        t.producers = producers;
+        t.consumers = consumers;
+        if (ops->init(&t))
+                exit(-1);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for (i = 0; i < producers + consumers; i++)
+        {
+                pid = fork_or_die();
+
+                if (pid == 0 && pin)
+                        pin_to_cpu(i);
+                if (pid == 0)
+                        trace_attach(i);
+                if (pid == 0 && i < producers)
+                {
+                        /* Producer */
+                        if (ops->attach)
+                                ops->attach(&t, TRANSPORT_PRODUCER);
+                        producer(&t, count, prod_interval, batch, getpid(), st, counters, aggregate);
+                }
+                if (pid == 0)
+                {
+                        /* Consumer */
+                        if (ops->attach)
+                                ops->attach(&t, TRANSPORT_CONSUMER);
+                        consumer(&t, con_interval, batch, st, counters, aggregate);
+                }
+        }
+
+        if (ops->attach)
+                ops->attach(&t, TRANSPORT_PARENT);
+
+        failed = reap_children(producers + consumers);
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        secs = elapsed_seconds(&start, &end);
+
+        if (trace_file)
+                trace_dump(trace_file);
+
+        fprintf(stderr, "%s: %d producer(s) x %d consumer(s): %d produced, %d consumed "
+                "in %.3f s (%.0f words/s)\n",
+                ops->name, producers, consumers, st->prod_count, st->con_count, secs,
+                secs > 0 ? st->con_count / secs : 0.0);
+        fprintf(stderr, "Latency: %.1f us mean, %.1f us max\n",
+                st->con_count ? st->latency_total_ns / 1e3 / st->con_count : 0.0,
+                st->latency_max_ns / 1e3);
+
+        if (counters)
+        {
+                perf_report("Producer", &st->prod_perf, st->prod_count);
+                perf_report("Consumer", &st->con_perf, st->con_count);
+        }
+
+        if (aggregate)
+        {
+                histogram_report("Consumed words", &st->consumed);
+                if (histogram_total(&st->consumed) != st->prod_count ||
+                    memcmp(&st->produced, &st->consumed, sizeof(word_histogram)) != 0)
+                {
+                        fprintf(stderr, "Error: Consumed counts (%ld words) don't match produced counts (%ld words)\n",
+                                histogram_total(&st->consumed), histogram_total(&st->produced));
+                        failed++;
+                }
+                else
+                        fprintf(stderr, "Consumed counts match produced counts\n");
+        }
+
+        if (failed)
+        {
+                fprintf(stderr, "Error: %d child process(es) did not exit cleanly\n", failed);
+                return -1;
+        }
+
+        return 0;
+}
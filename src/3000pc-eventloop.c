@@ -0,0 +1,512 @@
+/* 3000pc-eventloop.c  One event loop consuming from many queues, or one process per queue
+ * Copyright (C) 2020  William Findlay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+/* You really shouldn't be incorporating parts of this in any other code,
+   it is meant for teaching, not production */
+
+/* Producers spread their words over many queues, one per logical
+ * consumer. There are two ways to consume them:
+ *
+ *   -m process  one forked consumer per queue, blocked in pop() on it,
+ *               like every other program here
+ *   -m loop     a single process running one task per queue
+ *
+ * A task is a small state machine (struct task), not a thread or a
+ * process: it has no stack of its own, just a state and a few counters.
+ * The loop runs a task until its queue is empty, it has taken TASK_BUDGET
+ * words (so one busy queue can't starve the rest), or it is due for its
+ * con_interval sleep. A sleeping task just gets a wakeup time; the loop
+ * keeps serving the other queues in the meantime.
+ *
+ * A parked task can't wait on its queue's condition, since the loop would
+ * then be stuck on that one queue. Instead producers ring a shared
+ * doorbell: they set the queue's bit in a bitmap after every push, and
+ * signal the doorbell's condition only if the loop is asleep (the same
+ * waiter counting as queue.h) and nobody has signalled it since it went
+ * to sleep. The loop takes the whole bitmap at once, makes the tasks
+ * whose bits were set runnable, and only sleeps when it has nothing
+ * runnable left. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "words.h"
+#include "proc.h"
+
+#define QUEUESIZE 16
+#define MAX_QUEUES 4096
+#define TASK_BUDGET 16          /* words a task takes before the next task runs */
+
+#define QUEUE_NAME     wordq
+#define QUEUE_TYPE     word_t
+#define QUEUE_CAPACITY QUEUESIZE
+#define QUEUE_POLICY   QUEUE_MPSC
+#include "queue.h"
+
+#define BITS_PER_WORD (8 * sizeof(unsigned long))
+
+typedef struct doorbell {
+        pthread_mutex_t mutex;
+        pthread_cond_t ring;
+        int waiters;
+        int signalled;          /* somebody already woke the sleeping loop */
+        unsigned long ready[MAX_QUEUES / BITS_PER_WORD];  /* queues that got words */
+        long sent;              /* signals sent to a sleeping loop */
+        long avoided;           /* rings with nobody asleep */
+        long sleeps;            /* times the loop went to sleep */
+} doorbell;
+
+typedef struct shared {
+        int queues;
+        int producers_left;     /* the last producer closes every queue */
+        int prod_count;
+        int con_count;
+        doorbell bell;
+        wordq q[];
+} shared;
+
+#define TASK_PARKED   0         /* queue empty, waiting for the doorbell */
+#define TASK_RUNNABLE 1
+#define TASK_SLEEPING 2         /* con_interval pause until wake_ns */
+#define TASK_DONE     3
+
+typedef struct task {
+        int state;
+        int queue;
+        int consumed;
+        long wake_ns;
+        struct task *next;      /* run list or sleep list */
+} task;
+
+void usage_exit(char *progname)
+{
+        fprintf(stderr,
+                "Usage: %s [-p producers] [-q queues] [-m loop|process] "
+                "<event count> <prod interval int> <con interval int>\n"
+                "  <event count> is the number of words each producer queues\n"
+                "  -q is the number of queues, one per logical consumer (at most %d)\n"
+                "  -m loop serves every queue from one event loop process (default),\n"
+                "     -m process forks a consumer for each queue\n",
+                progname, MAX_QUEUES);
+        exit(-1);
+}
+
+void doorbell_init(doorbell *b)
+{
+        pthread_mutexattr_t mattr;
+        pthread_condattr_t cattr;
+
+        /* We need to explicitly mark the mutex as shared or
+           risk undefined behavior */
+        pthread_mutexattr_init(&mattr);
+        pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+        pthread_mutex_init(&b->mutex, &mattr);
+        pthread_mutexattr_destroy(&mattr);
+
+        /* We need to explicitly mark the conditions as shared or
+           risk undefined behavior */
+        pthread_condattr_init(&cattr);
+        pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+        pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+        pthread_cond_init(&b->ring, &cattr);
+        pthread_condattr_destroy(&cattr);
+
+        b->waiters = 0;
+        b->signalled = 0;
+        memset(b->ready, 0, sizeof(b->ready));
+        b->sent = b->avoided = b->sleeps = 0;
+}
+
+/* Called by a producer after pushing to queue k */
+void ring_bell(doorbell *b, int k)
+{
+        __atomic_fetch_or(&b->ready[k / BITS_PER_WORD], 1UL << (k % BITS_PER_WORD),
+                          __ATOMIC_RELEASE);
+
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&b->waiters, __ATOMIC_RELAXED) ||
+            __atomic_exchange_n(&b->signalled, 1, __ATOMIC_RELAXED))
+        {
+                __atomic_add_fetch(&b->avoided, 1, __ATOMIC_RELAXED);
+                return;
+        }
+
+        pthread_mutex_lock(&b->mutex);
+        pthread_cond_signal(&b->ring);
+        pthread_mutex_unlock(&b->mutex);
+        __atomic_add_fetch(&b->sent, 1, __ATOMIC_RELAXED);
+}
+
+int bell_rung(doorbell *b, int queues)
+{
+        int i;
+
+        for (i = 0; i < (queues + BITS_PER_WORD - 1) / BITS_PER_WORD; i++)
+        {
+                if (__atomic_load_n(&b->ready[i], __ATOMIC_ACQUIRE))
+                        return 1;
+        }
+
+        return 0;
+}
+
+/* Sleep until a producer rings, or until wake_ns if it isn't 0 */
+void wait_for_bell(doorbell *b, int queues, long wake_ns)
+{
+        struct timespec deadline;
+        int ret = 0;
+
+        deadline.tv_sec = wake_ns / 1000000000L;
+        deadline.tv_nsec = wake_ns % 1000000000L;
+
+        pthread_mutex_lock(&b->mutex);
+        b->sleeps++;
+        __atomic_store_n(&b->signalled, 0, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&b->waiters, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        while (!bell_rung(b, queues) && ret != ETIMEDOUT)
+        {
+                if (wake_ns)
+                        ret = pthread_cond_timedwait(&b->ring, &b->mutex, &deadline);
+                else
+                        pthread_cond_wait(&b->ring, &b->mutex);
+        }
+        __atomic_sub_fetch(&b->waiters, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&b->mutex);
+}
+
+void producer(shared *s, int id, int event_count, int prod_interval)
+{
+        word_t word;
+        int i, k;
+
+        srandom(getpid());
+
+        for (i=0; i < event_count; i++)
+        {
+                pick_random_word(word);
+                k = (id + i) % s->queues;
+                wordq_push(&s->q[k], &word);
+                ring_bell(&s->bell, k);
+                __atomic_add_fetch(&s->prod_count, 1, __ATOMIC_RELAXED);
+
+                /* Don't sleep if interval <= 0 */
+                if (prod_interval <= 0)
+                        continue;
+                /* Sleep if we hit our interval */
+                if (i % prod_interval == 0)
+                {
+                        fprintf(stderr, "Producer sleeping for 1 second...\n");
+                        sleep(1);
+                }
+        }
+
+        if (__atomic_sub_fetch(&s->producers_left, 1, __ATOMIC_ACQ_REL) == 0)
+        {
+                for (k = 0; k < s->queues; k++)
+                {
+                        wordq_close(&s->q[k]);
+                        ring_bell(&s->bell, k);
+                }
+        }
+
+        fprintf(stderr, "Producer finished.\n");
+        exit(0);
+}
+
+/* One consumer process per queue */
+void consumer(shared *s, int k, int con_interval)
+{
+        word_t word;
+        int i;
+
+        for (i=0; wordq_pop(&s->q[k], &word) == 0; i++)
+        {
+                output_word(i, word);
+
+                /* Don't sleep if interval <= 0 */
+                if (con_interval <= 0)
+                        continue;
+                /* Sleep if we hit our interval */
+                if (i % con_interval == 0)
+                {
+                        fprintf(stderr, "Consumer sleeping for 1 second...\n");
+                        sleep(1);
+                }
+        }
+
+        __atomic_add_fetch(&s->con_count, i, __ATOMIC_RELAXED);
+        exit(0);
+}
+
+/* Run t until its queue is empty, its budget is used up or it has to sleep */
+void task_step(shared *s, task *t, int con_interval)
+{
+        word_t word;
+        int n, ret;
+
+        for (n = 0; n < TASK_BUDGET; n++)
+        {
+                ret = wordq_try_pop(&s->q[t->queue], &word);
+                if (ret == QUEUE_EMPTY)
+                {
+                        t->state = TASK_PARKED;
+                        return;
+                }
+                if (ret < 0)
+                {
+                        t->state = TASK_DONE;
+                        return;
+                }
+
+                output_word(t->consumed++, word);
+
+                /* Don't sleep if interval <= 0 */
+                if (con_interval <= 0 || (t->consumed - 1) % con_interval != 0)
+                        continue;
+                /* Sleep if we hit our interval, without holding up the loop */
+                fprintf(stderr, "Task %d sleeping for 1 second...\n", t->queue);
+                t->state = TASK_SLEEPING;
+                t->wake_ns = now_ns() + 1000000000L;
+                return;
+        }
+}
+
+void event_loop(shared *s, int con_interval)
+{
+        task *tasks, *run = NULL, **run_tail = &run, *sleeping = NULL;
+        task *t, **tp, *batch;
+        unsigned long bits;
+        long now, wake_ns;
+        int i, b, done = 0, consumed = 0;
+
+        tasks = calloc(s->queues, sizeof(task));
+        if (!tasks)
+        {
+                report_error("Unable to allocate tasks");
+                exit(-1);
+        }
+
+        /* Every task starts runnable, in case words arrived before us */
+        for (i = 0; i < s->queues; i++)
+        {
+                tasks[i].queue = i;
+                tasks[i].state = TASK_RUNNABLE;
+                *run_tail = &tasks[i];
+                run_tail = &tasks[i].next;
+        }
+        *run_tail = NULL;
+
+        while (done < s->queues)
+        {
+                /* Make parked tasks whose queues got words runnable */
+                for (i = 0; i < (s->queues + BITS_PER_WORD - 1) / BITS_PER_WORD; i++)
+                {
+                        bits = __atomic_exchange_n(&s->bell.ready[i], 0, __ATOMIC_ACQUIRE);
+                        for (; bits; bits &= bits - 1)
+                        {
+                                b = __builtin_ctzl(bits);
+                                t = &tasks[i * BITS_PER_WORD + b];
+                                if (t->state != TASK_PARKED)
+                                        continue;
+                                t->state = TASK_RUNNABLE;
+                                t->next = NULL;
+                                *run_tail = t;
+                                run_tail = &t->next;
+                        }
+                }
+
+                /* Wake sleeping tasks that are due, and note the next one */
+                now = now_ns();
+                wake_ns = 0;
+                for (tp = &sleeping; (t = *tp) != NULL; )
+                {
+                        if (t->wake_ns <= now)
+                        {
+                                *tp = t->next;
+                                t->state = TASK_RUNNABLE;
+                                t->next = NULL;
+                                *run_tail = t;
+                                run_tail = &t->next;
+                                continue;
+                        }
+                        if (!wake_ns || t->wake_ns < wake_ns)
+                                wake_ns = t->wake_ns;
+                        tp = &t->next;
+                }
+
+                if (!run)
+                {
+                        wait_for_bell(&s->bell, s->queues, wake_ns);
+                        continue;
+                }
+
+                /* Run everything runnable once; tasks that are still
+                   runnable go to the back for the next round */
+                batch = run;
+                run = NULL;
+                run_tail = &run;
+                while ((t = batch) != NULL)
+                {
+                        batch = t->next;
+                        consumed -= t->consumed;
+                        task_step(s, t, con_interval);
+                        consumed += t->consumed;
+
+                        switch (t->state)
+                        {
+                                case TASK_RUNNABLE:
+                                        t->next = NULL;
+                                        *run_tail = t;
+                                        run_tail = &t->next;
+                                        break;
+                                case TASK_SLEEPING:
+                                        t->next = sleeping;
+                                        sleeping = t;
+                                        break;
+                                case TASK_DONE:
+                                        done++;
+                                        break;
+                        }
+                }
+        }
+
+        __atomic_add_fetch(&s->con_count, consumed, __ATOMIC_RELAXED);
+        free(tasks);
+        fprintf(stderr, "Event loop finished.\n");
+        exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+        int count, prod_interval, con_interval;
+        int producers = 1, queues = 64, loop = 1;
+        int i, opt, consumers, failed;
+        struct timespec start, end;
+        struct rusage ru;
+        size_t size;
+        double secs;
+
+        shared *s;
+
+        while ((opt = getopt(argc, argv, "p:q:m:")) != -1)
+        {
+                switch (opt)
+                {
+                        case 'p':
+                                producers = atoi(optarg);
+                                break;
+                        case 'q':
+                                queues = atoi(optarg);
+                                break;
+                        case 'm':
+                                if (strcmp(optarg, "loop") == 0)
+                                        loop = 1;
+                                else if (strcmp(optarg, "process") == 0)
+                                        loop = 0;
+                                else
+                                        usage_exit(argv[0]);
+                                break;
+                        default:
+                                usage_exit(argv[0]);
+                }
+        }
+
+        if (producers < 1 || queues < 1 || queues > MAX_QUEUES)
+        {
+                report_error("Bad producer or queue count");
+                usage_exit(argv[0]);
+        }
+
+        if (argc - optind < 3)
+        {
+                report_error("Not enough arguments");
+                usage_exit(argv[0]);
+        }
+
+        count = atoi(argv[optind]);
+        prod_interval = atoi(argv[optind + 1]);
+        con_interval = atoi(argv[optind + 2]);
+
+        size = sizeof(shared) + queues * sizeof(wordq);
+        s = (shared *) mmap(NULL, size,
+                             PROT_READ|PROT_WRITE,
+                             MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+
+        if (s == MAP_FAILED)
+        {
+                fprintf(stderr, "Error: Unable to mmap: %s\n", strerror(errno));
+                exit(-1);
+        }
+
+        s->queues = queues;
+        s->producers_left = producers;
+        s->prod_count = 0;
+        s->con_count = 0;
+        doorbell_init(&s->bell);
+        for (i = 0; i < queues; i++)
+                wordq_init(&s->q[i]);
+
+        consumers = loop ? 1 : queues;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for (i = 0; i < consumers + producers; i++)
+        {
+                if (fork_or_die() > 0)
+                        continue;
+
+                if (i >= consumers)
+                        producer(s, i - consumers, count, prod_interval);
+                else if (loop)
+                        event_loop(s, con_interval);
+                else
+                        consumer(s, i, con_interval);
+        }
+
+        failed = reap_children(consumers + producers);
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        secs = elapsed_seconds(&start, &end);
+        getrusage(RUSAGE_CHILDREN, &ru);
+
+        fprintf(stderr, "%s: %d producer(s) x %d queue(s) in %d consumer process(es): "
+                "%d produced, %d consumed in %.3f s (%.0f words/s)\n",
+                loop ? "Event loop" : "Process per queue", producers, queues, consumers,
+                s->prod_count, s->con_count, secs, secs > 0 ? s->con_count / secs : 0.0);
+        fprintf(stderr, "Context switches: %ld voluntary, %ld involuntary\n",
+                ru.ru_nvcsw, ru.ru_nivcsw);
+        if (loop)
+                fprintf(stderr, "Doorbell: loop slept %ld time(s), %ld signal(s) sent, "
+                        "%ld avoided\n", s->bell.sleeps, s->bell.sent, s->bell.avoided);
+
+        if (failed)
+        {
+                fprintf(stderr, "Error: %d child process(es) did not exit cleanly\n", failed);
+                return -1;
+        }
+
+        return 0;
+}
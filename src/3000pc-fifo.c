@@ -18,78 +18,49 @@
 /* You really shouldn't be incorporating parts of this in any other code,
    it is meant for teaching, not production */
 
+#define _GNU_SOURCE             /* pipe2, O_DIRECT, F_SETPIPE_SZ */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/wait.h>
 #include <errno.h>
 #include <string.h>
 #include <time.h>
 
-#define QUEUESIZE 32
-#define WORDSIZE 16
-
-const int wordlist_size = 27;
-const char *wordlist[] = {
-        "Alpha",
-        "Bravo",
-        "Charlie",
-        "Delta",
-        "Echo",
-        "Foxtrot",
-        "Golf",
-        "Hotel",
-        "India",
-        "Juliet",
-        "Kilo",
-        "Lima",
-        "Mike",
-        "November",
-        "Oscar",
-        "Papa",
-        "Quebec",
-        "Romeo",
-        "Sierra",
-        "Tango",
-        "Uniform",
-        "Victor",
-        "Whiskey",
-        "X-ray",
-        "Yankee",
-        "Zulu",
-        "Dash"
-};
-
-void report_error(char *error)
-{
-        fprintf(stderr, "Error: %s\n", error);
-}
+#include "words.h"
+#include "proc.h"
+
+/* Most records a producer sends in one write; BATCHMAX * WORDSIZE must
+   not exceed PIPE_BUF so each write stays atomic */
+#define BATCHMAX 64
+
+/* Counters shared by every process, in an anonymous shared mapping */
+typedef struct stats {
+        int prod_count;
+        int con_count;
+        int short_reads;        /* reads that ended partway through a record */
+} stats;
 
 void usage_exit(char *progname)
 {
         fprintf(stderr,
-                "Usage: %s <event count> <prod interval int> <con interval int>\n",
-                progname);
+                "Usage: %s [-p producers] [-c consumers] [-P] [-b batch] [-s pipe size] "
+                "<event count> <prod interval int> <con interval int>\n"
+                "  <event count> is the number of words each producer writes\n"
+                "  -P uses a packet mode pipe, so each read returns exactly one write;\n"
+                "     needed with more than one consumer\n"
+                "  -b sends up to batch words per write (at most %d)\n",
+                progname, BATCHMAX);
         exit(-1);
 }
 
-void pick_word(char *word)
+/* Write n words as one record batch */
+int queue_words(word_t *words, int n, int pipefd_write)
 {
-        int pick;
-
-        pick = random() % wordlist_size;
-
-        strcpy(word, wordlist[pick]);
-}
-
-void output_word(int c, char *w)
-{
-        printf("Word %d: %s\n", c, w);
-}
-
-int queue_word(char *word, int pipefd_write)
-{
-        if (write(pipefd_write, word, WORDSIZE) == -1)
+        if (write(pipefd_write, words, n * WORDSIZE) == -1)
         {
                 fprintf(stderr, "Error: Unable to write to pipe: %s\n", strerror(errno));
                 return -1;
@@ -98,26 +69,59 @@ int queue_word(char *word, int pipefd_write)
         return 0;
 }
 
-int get_next_word(char *word, int pipefd_read)
+/* Read up to max words. Returns the number of words read, 0 once every
+ * producer has closed its end, or -1 on error.
+ *
+ * In packet mode each read returns exactly one batch. An ordinary pipe is
+ * just a stream of bytes, so a read can stop partway through a record.
+ * With one consumer the rest of the record is the next thing in the pipe
+ * and is read straight away; with several it could go to somebody else,
+ * corrupting both records, which is why main() insists on packet mode. */
+int get_next_words(word_t *words, int max, int pipefd_read, stats *st)
 {
-        if (read(pipefd_read, word, WORDSIZE) == -1)
+        ssize_t got, more;
+
+        got = read(pipefd_read, words, max * WORDSIZE);
+        if (got == -1)
         {
                 fprintf(stderr, "Error: Unable to read from pipe: %s\n", strerror(errno));
                 return -1;
         }
 
-        return 0;
+        if (got % WORDSIZE)
+        {
+                __atomic_add_fetch(&st->short_reads, 1, __ATOMIC_RELAXED);
+                /* finish off the record we started */
+                while (got % WORDSIZE)
+                {
+                        more = read(pipefd_read, (char *) words + got,
+                                    WORDSIZE - got % WORDSIZE);
+                        if (more <= 0)
+                                break;
+                        got += more;
+                }
+        }
+
+        return got / WORDSIZE;
 }
 
-void producer(int event_count, int pipefd_write, int prod_interval)
+void producer(int event_count, int pipefd_write, int prod_interval,
+              int batch, unsigned int seed, stats *st)
 {
-        char word[WORDSIZE];
-        int i;
+        word_t words[BATCHMAX];
+        int i, n = 0;
+
+        srandom(seed);
 
         for (i=0; i < event_count; i++)
         {
-                pick_word(word);
-                queue_word(word, pipefd_write);
+                pick_random_word(words[n++]);
+                if (n == batch || i == event_count - 1)
+                {
+                        if (queue_words(words, n, pipefd_write) == 0)
+                                __atomic_add_fetch(&st->prod_count, n, __ATOMIC_RELAXED);
+                        n = 0;
+                }
 
                 /* Don't sleep if interval <= 0 */
                 if (prod_interval <= 0)
@@ -135,24 +139,29 @@ void producer(int event_count, int pipefd_write, int prod_interval)
         exit(0);
 }
 
-void consumer(int event_count, int pipefd_read, int con_interval)
+void consumer(int pipefd_read, int con_interval, stats *st)
 {
-        char word[WORDSIZE];
-        int i;
+        word_t words[BATCHMAX];
+        int i, k, n;
 
-        for (i=0; i < event_count; i++)
+        /* Keep reading until every producer has closed its end */
+        for (i=0; (n = get_next_words(words, BATCHMAX, pipefd_read, st)) > 0; )
         {
-                get_next_word(word, pipefd_read);
-                output_word(i, word);
+                __atomic_add_fetch(&st->con_count, n, __ATOMIC_RELAXED);
 
-                /* Don't sleep if interval <= 0 */
-                if (con_interval <= 0)
-                        continue;
-                /* Sleep if we hit our interval */
-                if (con_interval > 0 && i % con_interval == 0)
+                for (k=0; k < n; k++, i++)
                 {
-                        fprintf(stderr, "Consumer sleeping for 1 second...\n");
-                        sleep(1);
+                        output_word(i, words[k]);
+
+                        /* Don't sleep if interval <= 0 */
+                        if (con_interval <= 0)
+                                continue;
+                        /* Sleep if we hit our interval */
+                        if (con_interval > 0 && i % con_interval == 0)
+                        {
+                                fprintf(stderr, "Consumer sleeping for 1 second...\n");
+                                sleep(1);
+                        }
                 }
         }
 
@@ -164,50 +173,127 @@ void consumer(int event_count, int pipefd_read, int con_interval)
 int main(int argc, char *argv[])
 {
         int pid, count, prod_interval, con_interval;
+        int producers = 1, consumers = 1, packet = 0, batch = 1, pipe_size = 0;
+        int i, opt, failed;
+        unsigned int seed;
+        struct timespec start, end;
+        double secs;
         int pipefd[2];
+        stats *st;
 
-        srandom(time(NULL));
+        seed = time(NULL);
+        srandom(seed);
 
-        if (argc < 4)
+        while ((opt = getopt(argc, argv, "p:c:Pb:s:")) != -1)
         {
-                if (argc < 1)
+                switch (opt)
                 {
-                        report_error("no command line");
-                        usage_exit(argv[0]);
-                }
-                else
-                {
-                        report_error("Not enough arguments");
-                        usage_exit(argv[0]);
+                        case 'p':
+                                producers = atoi(optarg);
+                                break;
+                        case 'c':
+                                consumers = atoi(optarg);
+                                break;
+                        case 'P':
+                                packet = 1;
+                                break;
+                        case 'b':
+                                batch = atoi(optarg);
+                                break;
+                        case 's':
+                                pipe_size = atoi(optarg);
+                                break;
+                        default:
+                                usage_exit(argv[0]);
                 }
         }
 
-        count = atoi(argv[1]);
-        prod_interval = atoi(argv[2]);
-        con_interval = atoi(argv[3]);
+        if (producers < 1 || consumers < 1 || batch < 1 || batch > BATCHMAX)
+        {
+                report_error("Bad producer, consumer or batch count");
+                usage_exit(argv[0]);
+        }
+
+        /* see get_next_words() */
+        if (consumers > 1 && !packet)
+        {
+                report_error("More than one consumer needs a packet mode pipe (-P)");
+                usage_exit(argv[0]);
+        }
+
+        if (argc - optind < 3)
+        {
+                report_error("Not enough arguments");
+                usage_exit(argv[0]);
+        }
+
+        count = atoi(argv[optind]);
+        prod_interval = atoi(argv[optind + 1]);
+        con_interval = atoi(argv[optind + 2]);
+
+        st = (stats *) mmap(NULL, sizeof(stats),
+                            PROT_READ|PROT_WRITE,
+                            MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+
+        if (st == MAP_FAILED)
+        {
+                fprintf(stderr, "Error: Unable to mmap: %s\n", strerror(errno));
+                exit(-1);
+        }
 
         /* Open a fifo
          * pipefd[0] will be open for reading, and
-         * pipefd[1] will be open for writing */
-        if (pipe(pipefd))
+         * pipefd[1] will be open for writing
+         * O_DIRECT makes it a packet mode pipe, see pipe(2) */
+        if (pipe2(pipefd, packet ? O_DIRECT : 0))
         {
                 fprintf(stderr, "Error: Unable to open pipe: %s\n", strerror(errno));
                 exit(-1);
         }
 
-        pid = fork();
+        if (pipe_size > 0 && fcntl(pipefd[1], F_SETPIPE_SZ, pipe_size) == -1)
+                fprintf(stderr, "Error: Unable to set pipe size: %s\n", strerror(errno));
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
 
-        if (pid)
+        for (i = 0; i < producers + consumers; i++)
         {
-                /* Producer */
-                producer(count, pipefd[1], prod_interval);
+                pid = fork_or_die();
+
+                if (pid == 0 && i < producers)
+                {
+                        /* Producer */
+                        close(pipefd[0]);
+                        producer(count, pipefd[1], prod_interval, batch, seed + i, st);
+                }
+                if (pid == 0)
+                {
+                        /* Consumer */
+                        close(pipefd[1]);
+                        consumer(pipefd[0], con_interval, st);
+                }
         }
-        else
+
+        /* Consumers only see end of file once every write end is closed,
+           including ours */
+        close(pipefd[0]);
+        close(pipefd[1]);
+
+        failed = reap_children(producers + consumers);
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        secs = elapsed_seconds(&start, &end);
+
+        fprintf(stderr, "%d producer(s) x %d consumer(s): %d produced, %d consumed "
+                "in %.3f s (%.0f words/s), %d short read(s)\n",
+                producers, consumers, st->prod_count, st->con_count, secs,
+                secs > 0 ? st->con_count / secs : 0.0, st->short_reads);
+
+        if (failed)
         {
-                /* Consumer */
-                consumer(count, pipefd[0], con_interval);
+                fprintf(stderr, "Error: %d child process(es) did not exit cleanly\n", failed);
+                return -1;
         }
 
-        /* This line should never be reached */
-        return -1;
+        return 0;
 }
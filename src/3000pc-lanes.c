@@ -0,0 +1,287 @@
+/* 3000pc-lanes.c  Urgent and bulk producers sharing a multi-lane priority queue in mmap shared memory
+ * Copyright (C) 2020  William Findlay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+/* You really shouldn't be incorporating parts of this in any other code,
+   it is meant for teaching, not production */
+
+/* The bulk producers fill the last (least urgent) lane as fast as they
+ * can, while one producer per other lane sends a word every interval
+ * microseconds until the bulk producers are done. The per-lane report
+ * then shows how long the urgent words waited despite the backlog. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "words.h"
+#include "proc.h"
+
+#define QUEUESIZE 32
+
+#define LANES_NAME     wordlanes
+#define LANES_TYPE     word_t
+#define LANES_CAPACITY QUEUESIZE
+#include "lanes.h"
+
+typedef struct shared {
+        wordlanes queue;
+        int bulk_left;          /* bulk producers still sending */
+        int producers_left;     /* the last one out closes the queue */
+        int con_count;
+} shared;
+
+void usage_exit(char *progname)
+{
+        fprintf(stderr,
+                "Usage: %s [-l lanes] [-b bulk producers] [-c consumers] [-s strict|wrr] "
+                "[-w weight,...] [-S starvation limit] [-i interval us] "
+                "<event count> <prod interval int> <con interval int>\n"
+                "  -l number of lanes (1 to %d, default 3); lane 0 is the most urgent\n"
+                "  -b producers sending <event count> words each to the last lane\n"
+                "  -s how consumers pick a lane: strict priority or weighted round robin\n"
+                "  -w weights for -s wrr, one per lane (default 2^(lanes - 1 - lane))\n"
+                "  -S with -s strict, serve a lane passed over this many times (0: never)\n"
+                "  -i how often each of the other lanes gets a word, in microseconds\n",
+                progname, LANES_MAX);
+        exit(-1);
+}
+
+void producer_done(shared *s)
+{
+        if (__atomic_sub_fetch(&s->producers_left, 1, __ATOMIC_ACQ_REL) == 0)
+                wordlanes_close(&s->queue);
+}
+
+void bulk_producer(shared *s, int event_count, int prod_interval)
+{
+        word_t word;
+        int i;
+
+        srandom(getpid());
+
+        for (i=0; i < event_count; i++)
+        {
+                pick_random_word(word);
+                wordlanes_push(&s->queue, s->queue.nlanes - 1, &word);
+
+                /* Don't sleep if interval <= 0 */
+                if (prod_interval <= 0)
+                        continue;
+                /* Sleep if we hit our interval */
+                if (i % prod_interval == 0)
+                {
+                        fprintf(stderr, "Producer sleeping for 1 second...\n");
+                        sleep(1);
+                }
+        }
+
+        __atomic_sub_fetch(&s->bulk_left, 1, __ATOMIC_RELEASE);
+        producer_done(s);
+        fprintf(stderr, "Bulk producer finished.\n");
+        exit(0);
+}
+
+/* Keeps sending until the bulk producers are done, so the urgent words
+   are measured while there is a backlog */
+void paced_producer(shared *s, int lane, int interval_us)
+{
+        struct timespec gap = { interval_us / 1000000, (interval_us % 1000000) * 1000L };
+        word_t word;
+
+        srandom(getpid());
+
+        while (__atomic_load_n(&s->bulk_left, __ATOMIC_ACQUIRE))
+        {
+                pick_random_word(word);
+                wordlanes_push(&s->queue, lane, &word);
+                nanosleep(&gap, NULL);
+        }
+
+        producer_done(s);
+        fprintf(stderr, "Lane %d producer finished.\n", lane);
+        exit(0);
+}
+
+void consumer(shared *s, int con_interval)
+{
+        word_t word;
+        int i, lane;
+
+        for (i=0; (lane = wordlanes_pop(&s->queue, &word)) >= 0; i++)
+        {
+                printf("Word %d (lane %d): %s\n",
+                       __atomic_add_fetch(&s->con_count, 1, __ATOMIC_RELAXED), lane, word);
+
+                /* Don't sleep if interval <= 0 */
+                if (con_interval <= 0)
+                        continue;
+                /* Sleep if we hit our interval */
+                if (i % con_interval == 0)
+                {
+                        fprintf(stderr, "Consumer sleeping for 1 second...\n");
+                        sleep(1);
+                }
+        }
+
+        fprintf(stderr, "Consumer finished.\n");
+        exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+        int count, prod_interval, con_interval;
+        int nlanes = 3, bulk = 2, consumers = 1, policy = LANES_STRICT;
+        int weights[LANES_MAX], nweights = 0, starve_limit = 16, interval_us = 1000;
+        int i, opt, failed;
+        long pushed = 0;
+        struct timespec start, end;
+        double secs;
+
+        shared *s;
+
+        while ((opt = getopt(argc, argv, "l:b:c:s:w:S:i:")) != -1)
+        {
+                switch (opt)
+                {
+                        case 'l':
+                                nlanes = atoi(optarg);
+                                break;
+                        case 'b':
+                                bulk = atoi(optarg);
+                                break;
+                        case 'c':
+                                consumers = atoi(optarg);
+                                break;
+                        case 's':
+                                if (lanes_parse_policy(optarg, &policy))
+                                        usage_exit(argv[0]);
+                                break;
+                        case 'w':
+                                if ((nweights = lanes_parse_weights(optarg, weights)) < 0)
+                                        usage_exit(argv[0]);
+                                break;
+                        case 'S':
+                                starve_limit = atoi(optarg);
+                                break;
+                        case 'i':
+                                interval_us = atoi(optarg);
+                                break;
+                        default:
+                                usage_exit(argv[0]);
+                }
+        }
+
+        if (nlanes < 1 || nlanes > LANES_MAX)
+        {
+                fprintf(stderr, "Error: Need between 1 and %d lanes\n", LANES_MAX);
+                usage_exit(argv[0]);
+        }
+
+        if (bulk < 1 || consumers < 1)
+        {
+                report_error("Need at least one bulk producer and one consumer");
+                usage_exit(argv[0]);
+        }
+
+        if (nweights && nweights != nlanes)
+        {
+                fprintf(stderr, "Error: Need one weight for each of the %d lanes\n", nlanes);
+                usage_exit(argv[0]);
+        }
+
+        if (starve_limit < 0 || interval_us < 1)
+        {
+                report_error("The starvation limit can't be negative and the interval must be positive");
+                usage_exit(argv[0]);
+        }
+
+        if (argc - optind < 3)
+        {
+                report_error("Not enough arguments");
+                usage_exit(argv[0]);
+        }
+
+        count = atoi(argv[optind]);
+        prod_interval = atoi(argv[optind + 1]);
+        con_interval = atoi(argv[optind + 2]);
+
+        s = (shared *) mmap(NULL, sizeof(shared),
+                             PROT_READ|PROT_WRITE,
+                             MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+
+        if (s == MAP_FAILED)
+        {
+                fprintf(stderr, "Error: Unable to mmap: %s\n", strerror(errno));
+                exit(-1);
+        }
+
+        wordlanes_init(&s->queue, nlanes, policy, nweights ? weights : NULL, starve_limit);
+        s->bulk_left = bulk;
+        s->producers_left = bulk + nlanes - 1;
+        s->con_count = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        /* Consumers first, so the urgent lanes are watched from the start */
+        for (i = 0; i < consumers; i++)
+        {
+                if (fork_or_die() == 0)
+                        consumer(s, con_interval);
+        }
+        for (i = 0; i < nlanes - 1; i++)
+        {
+                if (fork_or_die() == 0)
+                        paced_producer(s, i, interval_us);
+        }
+        for (i = 0; i < bulk; i++)
+        {
+                if (fork_or_die() == 0)
+                        bulk_producer(s, count, prod_interval);
+        }
+
+        failed = reap_children(consumers + nlanes - 1 + bulk);
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        secs = elapsed_seconds(&start, &end);
+
+        for (i = 0; i < nlanes; i++)
+                pushed += s->queue.lanes[i].stats.pushed;
+
+        fprintf(stderr, "%d lane(s), %d bulk producer(s) x %d consumer(s): %ld pushed, "
+                "%d consumed in %.3f s (%.0f words/s)\n",
+                nlanes, bulk, consumers, pushed, s->con_count, secs,
+                secs > 0 ? s->con_count / secs : 0.0);
+        wordlanes_report(&s->queue);
+
+        if (failed)
+        {
+                fprintf(stderr, "Error: %d child process(es) did not exit cleanly\n", failed);
+                return -1;
+        }
+        if (s->con_count != pushed)
+        {
+                fprintf(stderr, "Error: %ld words pushed but %d consumed\n", pushed, s->con_count);
+                return -1;
+        }
+
+        return 0;
+}
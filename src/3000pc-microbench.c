@@ -0,0 +1,510 @@
+/* 3000pc-microbench.c  Costs of the primitives the producer-consumer programs are built from
+ * Copyright (C) 2020  William Findlay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+/* You really shouldn't be incorporating parts of this in any other code,
+   it is meant for teaching, not production */
+
+/* Times one primitive at a time: a process-shared mutex with and without
+ * a second process fighting for it, pthread_cond_signal with nobody
+ * waiting and as a two process ping-pong, sem_wait/sem_post as on a slot
+ * lock, pick_word()'s trip to /dev/urandom, a shared cache line bounced
+ * between two processes, and a one byte round trip through two pipes.
+ *
+ * Each benchmark runs its loop a few times untimed to warm up, then -r
+ * timed repetitions of its loop. Each repetition gives a time per
+ * operation; we report the median of those, the median absolute deviation
+ * from it (MAD, a spread that one unlucky repetition can't skew) and the
+ * fastest. Round trip benchmarks count one round trip as an operation.
+ *
+ * Two process benchmarks fork a partner that lives for the whole
+ * benchmark. With -a the two are pinned to different CPUs, so the ping
+ * pongs really cross cores; on a single CPU machine they measure context
+ * switches instead. */
+
+#define _GNU_SOURCE             /* sched_setaffinity */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "words.h"
+#include "proc.h"
+
+#define DEFAULT_REPS   15
+#define DEFAULT_WARMUP 3
+#define MAX_REPS       1000
+
+/* Everything the benchmarks share with their partner process */
+typedef struct bench_state {
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+        sem_t sem;
+        int turn;               /* cond ping-pong: 1 while it's the partner's go */
+        int stop;               /* tells the partner to finish */
+        int ball __attribute__((aligned(64)));  /* on a cache line of its own */
+        int to_partner[2];      /* pipes for the round trip */
+        int from_partner[2];
+        pid_t partner;
+        int pin;
+} bench_state;
+
+typedef struct bench {
+        const char *name;
+        const char *description;
+        int iterations;         /* operations per repetition */
+        void (*start)(bench_state *b);          /* may be NULL */
+        void (*run)(bench_state *b, int n);
+        void (*stop)(bench_state *b);           /* may be NULL */
+} bench;
+
+void usage_exit(char *progname)
+{
+        fprintf(stderr,
+                "Usage: %s [-r repetitions] [-w warmup] [-s scale] [-a] [-l] [benchmark...]\n"
+                "  runs every benchmark, or just the ones named\n"
+                "  -r timed repetitions of each benchmark (default %d)\n"
+                "  -w untimed warm-up repetitions (default %d)\n"
+                "  -s multiplies every benchmark's operations per repetition\n"
+                "  -a pins the two processes of a ping-pong to different CPUs\n"
+                "  -l lists the benchmarks\n",
+                progname, DEFAULT_REPS, DEFAULT_WARMUP);
+        exit(-1);
+}
+
+/* Pin the calling process to CPU k, wrapping around if there are fewer */
+void pin_to_cpu(int k)
+{
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(k % (cpus > 0 ? cpus : 1), &set);
+        if (sched_setaffinity(0, sizeof(set), &set) == -1)
+                fprintf(stderr, "Error: Unable to set CPU affinity: %s\n", strerror(errno));
+}
+
+/* Fork a partner running fn until told to stop */
+void start_partner(bench_state *b, void (*fn)(bench_state *b))
+{
+        b->stop = 0;
+        /* or the table so far would be printed again by the partner */
+        fflush(stdout);
+        b->partner = fork_or_die();
+
+        if (b->partner == 0)
+        {
+                if (b->pin)
+                        pin_to_cpu(1);
+                fn(b);
+                _exit(0);
+        }
+}
+
+void stop_partner(bench_state *b)
+{
+        __atomic_store_n(&b->stop, 1, __ATOMIC_RELEASE);
+        waitpid(b->partner, NULL, 0);
+}
+
+/* Process-shared mutex, nobody else using it */
+
+void mutex_run(bench_state *b, int n)
+{
+        int i;
+
+        for (i = 0; i < n; i++)
+        {
+                pthread_mutex_lock(&b->mutex);
+                pthread_mutex_unlock(&b->mutex);
+        }
+}
+
+/* ... and with a partner taking it in a loop too */
+
+void mutex_partner(bench_state *b)
+{
+        while (!__atomic_load_n(&b->stop, __ATOMIC_ACQUIRE))
+        {
+                pthread_mutex_lock(&b->mutex);
+                pthread_mutex_unlock(&b->mutex);
+        }
+}
+
+void mutex_contended_start(bench_state *b)
+{
+        start_partner(b, mutex_partner);
+}
+
+/* pthread_cond_signal with no waiters, as when a consumer keeps up */
+
+void cond_idle_run(bench_state *b, int n)
+{
+        int i;
+
+        for (i = 0; i < n; i++)
+        {
+                pthread_mutex_lock(&b->mutex);
+                pthread_cond_signal(&b->cond);
+                pthread_mutex_unlock(&b->mutex);
+        }
+}
+
+/* A signal that has to wake somebody, there and back */
+
+void cond_pingpong_partner(bench_state *b)
+{
+        pthread_mutex_lock(&b->mutex);
+        for (;;)
+        {
+                while (!b->turn && !b->stop)
+                        pthread_cond_wait(&b->cond, &b->mutex);
+                if (b->stop)
+                        break;
+                b->turn = 0;
+                pthread_cond_signal(&b->cond);
+        }
+        pthread_mutex_unlock(&b->mutex);
+}
+
+void cond_pingpong_start(bench_state *b)
+{
+        b->turn = 0;
+        start_partner(b, cond_pingpong_partner);
+}
+
+void cond_pingpong_run(bench_state *b, int n)
+{
+        int i;
+
+        pthread_mutex_lock(&b->mutex);
+        for (i = 0; i < n; i++)
+        {
+                b->turn = 1;
+                pthread_cond_signal(&b->cond);
+                while (b->turn)
+                        pthread_cond_wait(&b->cond, &b->mutex);
+        }
+        pthread_mutex_unlock(&b->mutex);
+}
+
+void cond_pingpong_stop(bench_state *b)
+{
+        pthread_mutex_lock(&b->mutex);
+        b->stop = 1;
+        pthread_cond_signal(&b->cond);
+        pthread_mutex_unlock(&b->mutex);
+        waitpid(b->partner, NULL, 0);
+}
+
+/* sem_wait/sem_post on a semaphore used as a lock, as entry.lock was */
+
+void sem_run(bench_state *b, int n)
+{
+        int i;
+
+        for (i = 0; i < n; i++)
+        {
+                sem_wait(&b->sem);
+                sem_post(&b->sem);
+        }
+}
+
+/* pick_word() opens, reads and closes /dev/urandom every time */
+
+void urandom_run(bench_state *b, int n)
+{
+        char word[WORDSIZE];
+        int i;
+
+        for (i = 0; i < n; i++)
+                pick_word(word);
+}
+
+/* One cache line bounced between two processes: we set ball, the partner
+ * clears it. Waiting spins for a while and then yields, so the benchmark
+ * still finishes when both share one CPU. */
+
+static inline void wait_for_ball(bench_state *b, int value)
+{
+        int spins = 0;
+
+        while (__atomic_load_n(&b->ball, __ATOMIC_ACQUIRE) != value &&
+               !__atomic_load_n(&b->stop, __ATOMIC_RELAXED))
+        {
+                if (++spins % 128 == 0)
+                        sched_yield();
+        }
+}
+
+void cacheline_partner(bench_state *b)
+{
+        while (!__atomic_load_n(&b->stop, __ATOMIC_RELAXED))
+        {
+                wait_for_ball(b, 1);
+                __atomic_store_n(&b->ball, 0, __ATOMIC_RELEASE);
+        }
+}
+
+void cacheline_start(bench_state *b)
+{
+        b->ball = 0;
+        start_partner(b, cacheline_partner);
+}
+
+void cacheline_run(bench_state *b, int n)
+{
+        int i;
+
+        for (i = 0; i < n; i++)
+        {
+                __atomic_store_n(&b->ball, 1, __ATOMIC_RELEASE);
+                wait_for_ball(b, 0);
+        }
+}
+
+/* One byte there and back through a pair of pipes */
+
+void pipe_partner(bench_state *b)
+{
+        char c;
+
+        close(b->to_partner[1]);
+        close(b->from_partner[0]);
+        while (read(b->to_partner[0], &c, 1) == 1)
+        {
+                if (write(b->from_partner[1], &c, 1) != 1)
+                        break;
+        }
+}
+
+void pipe_start(bench_state *b)
+{
+        if (pipe(b->to_partner) == -1 || pipe(b->from_partner) == -1)
+        {
+                fprintf(stderr, "Error: Unable to create pipes: %s\n", strerror(errno));
+                exit(-1);
+        }
+        start_partner(b, pipe_partner);
+        close(b->to_partner[0]);
+        close(b->from_partner[1]);
+}
+
+void pipe_run(bench_state *b, int n)
+{
+        char c = 'x';
+        int i;
+
+        for (i = 0; i < n; i++)
+        {
+                if (write(b->to_partner[1], &c, 1) != 1 ||
+                    read(b->from_partner[0], &c, 1) != 1)
+                {
+                        fprintf(stderr, "Error: Pipe round trip failed: %s\n", strerror(errno));
+                        exit(-1);
+                }
+        }
+}
+
+void pipe_stop(bench_state *b)
+{
+        /* the partner stops when it reads end of file */
+        close(b->to_partner[1]);
+        close(b->from_partner[0]);
+        waitpid(b->partner, NULL, 0);
+}
+
+static const bench benches[] = {
+        {"mutex",          "shared pthread mutex lock+unlock, uncontended",
+         1000000, NULL,                 mutex_run,         NULL},
+        {"mutex-contended", "shared pthread mutex lock+unlock, with a second process",
+         200000,  mutex_contended_start, mutex_run,        stop_partner},
+        {"cond-idle",      "lock, pthread_cond_signal with no waiters, unlock",
+         1000000, NULL,                 cond_idle_run,     NULL},
+        {"cond-pingpong",  "pthread_cond_signal that wakes a waiter, round trip",
+         20000,   cond_pingpong_start,  cond_pingpong_run, cond_pingpong_stop},
+        {"sem",            "sem_wait+sem_post on a shared semaphore",
+         1000000, NULL,                 sem_run,           NULL},
+        {"urandom",        "pick_word() via /dev/urandom",
+         20000,   NULL,                 urandom_run,       NULL},
+        {"cacheline",      "shared cache line ping-pong between two processes, round trip",
+         20000,   cacheline_start,      cacheline_run,     stop_partner},
+        {"pipe",           "one byte pipe round trip between two processes",
+         20000,   pipe_start,           pipe_run,          pipe_stop},
+};
+
+#define NBENCHES ((int) (sizeof(benches) / sizeof(benches[0])))
+
+void list_benches(void)
+{
+        int i;
+
+        for (i = 0; i < NBENCHES; i++)
+                fprintf(stderr, "  %-16s %s\n", benches[i].name, benches[i].description);
+}
+
+void init_state(bench_state *b, int pin)
+{
+        pthread_mutexattr_t mattr;
+        pthread_condattr_t cattr;
+
+        pthread_mutexattr_init(&mattr);
+        pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+        pthread_mutex_init(&b->mutex, &mattr);
+        pthread_mutexattr_destroy(&mattr);
+
+        pthread_condattr_init(&cattr);
+        pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+        pthread_cond_init(&b->cond, &cattr);
+        pthread_condattr_destroy(&cattr);
+
+        sem_init(&b->sem, 1, 1);
+
+        b->pin = pin;
+}
+
+int compare_doubles(const void *a, const void *b)
+{
+        double x = *(const double *) a, y = *(const double *) b;
+
+        return (x > y) - (x < y);
+}
+
+/* Sorts v */
+double median(double *v, int n)
+{
+        qsort(v, n, sizeof(double), compare_doubles);
+        return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+void run_bench(const bench *bn, bench_state *b, int reps, int warmup, double scale)
+{
+        double per_op[MAX_REPS], dev[MAX_REPS], med, mad, min;
+        long start;
+        int i, n = bn->iterations * scale;
+
+        if (n < 1)
+                n = 1;
+
+        if (bn->start)
+                bn->start(b);
+
+        for (i = 0; i < warmup; i++)
+                bn->run(b, n);
+
+        for (i = 0; i < reps; i++)
+        {
+                start = now_ns();
+                bn->run(b, n);
+                per_op[i] = (double) (now_ns() - start) / n;
+        }
+
+        if (bn->stop)
+                bn->stop(b);
+
+        med = median(per_op, reps);
+        min = per_op[0];        /* median() sorted them */
+        for (i = 0; i < reps; i++)
+                dev[i] = per_op[i] > med ? per_op[i] - med : med - per_op[i];
+        mad = median(dev, reps);
+
+        printf("%-16s %9d %12.1f %10.1f %12.1f\n", bn->name, n, med, mad, min);
+        fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+        int reps = DEFAULT_REPS, warmup = DEFAULT_WARMUP, pin = 0;
+        int i, k, opt, found;
+        double scale = 1.0;
+        bench_state *b;
+
+        while ((opt = getopt(argc, argv, "r:w:s:al")) != -1)
+        {
+                switch (opt)
+                {
+                        case 'r':
+                                reps = atoi(optarg);
+                                break;
+                        case 'w':
+                                warmup = atoi(optarg);
+                                break;
+                        case 's':
+                                scale = atof(optarg);
+                                break;
+                        case 'a':
+                                pin = 1;
+                                break;
+                        case 'l':
+                                list_benches();
+                                exit(0);
+                        default:
+                                usage_exit(argv[0]);
+                }
+        }
+
+        if (reps < 1 || reps > MAX_REPS || warmup < 0 || scale <= 0)
+        {
+                report_error("Bad repetition, warm-up or scale");
+                usage_exit(argv[0]);
+        }
+
+        for (k = optind; k < argc; k++)
+        {
+                for (i = 0, found = 0; i < NBENCHES; i++)
+                        found |= strcmp(argv[k], benches[i].name) == 0;
+                if (!found)
+                {
+                        fprintf(stderr, "Error: Unknown benchmark %s, pick from:\n", argv[k]);
+                        list_benches();
+                        exit(-1);
+                }
+        }
+
+        b = (bench_state *) mmap(NULL, sizeof(bench_state),
+                                 PROT_READ|PROT_WRITE,
+                                 MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+
+        if (b == MAP_FAILED)
+        {
+                fprintf(stderr, "Error: Unable to mmap: %s\n", strerror(errno));
+                exit(-1);
+        }
+
+        init_state(b, pin);
+        if (pin)
+                pin_to_cpu(0);
+
+        printf("%-16s %9s %12s %10s %12s\n", "benchmark", "ops/rep", "median ns/op", "MAD", "min ns/op");
+        for (i = 0; i < NBENCHES; i++)
+        {
+                /* with no names given run them all */
+                for (k = optind, found = optind == argc; k < argc; k++)
+                        found |= strcmp(argv[k], benches[i].name) == 0;
+                if (found)
+                        run_bench(&benches[i], b, reps, warmup, scale);
+        }
+
+        return 0;
+}
@@ -0,0 +1,599 @@
+/* 3000pc-pipeline.c  Producers, parallel transform stages and a sink chained with shared queues
+ * Copyright (C) 2020  William Findlay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+/* You really shouldn't be incorporating parts of this in any other code,
+   it is meant for teaching, not production */
+
+/* The other programs move words one hop, from producer to consumer. Here
+ * words go through a chain of stages:
+ *
+ *   producers -> queue -> stage 1 workers -> queue -> ... -> queue -> sink
+ *
+ * Each stage applies a transform to every word and can have several
+ * workers taking from the same queue. Queues between one writer and one
+ * reader can use the SPSC queue; the rest use MPMC.
+ *
+ * Words pick up a sequence number when they are produced. With parallel
+ * workers they can reach the sink out of order; -r makes the sink hold
+ * them back and print them in sequence order again. The sink only holds
+ * REORDER_WINDOW words. If a word is so far behind that the window fills,
+ * the sink gives up waiting for it, and prints it late when it turns up. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "words.h"
+#include "proc.h"
+
+#define QUEUESIZE 32
+#define MAX_STAGES 4
+#define MAX_WORKERS 16
+#define REORDER_WINDOW 4096
+
+typedef struct work_item {
+        unsigned long seq;
+        word_t word;
+} work_item;
+
+#define QUEUE_NAME     itemq_spsc
+#define QUEUE_TYPE     work_item
+#define QUEUE_CAPACITY QUEUESIZE
+#define QUEUE_POLICY   QUEUE_SPSC
+#include "queue.h"
+
+#define QUEUE_NAME     itemq_mpmc
+#define QUEUE_TYPE     work_item
+#define QUEUE_CAPACITY QUEUESIZE
+#define QUEUE_POLICY   QUEUE_MPMC
+#include "queue.h"
+
+#define HOP_AUTO 0
+#define HOP_SPSC 1
+#define HOP_MPMC 2
+
+/* How full a queue was each time its reader took from it */
+typedef struct hop_occupancy {
+        long total;
+        long samples;
+        int max;
+} hop_occupancy;
+
+/* The queue between stage k and stage k + 1 */
+typedef struct hop {
+        int spsc;               /* one writer and one reader */
+        int writers_left;       /* the last writer to finish closes the queue */
+        itemq_spsc sq;
+        itemq_mpmc mq;
+        hop_occupancy occupancy;
+} hop;
+
+typedef struct stage_stats {
+        int items;
+        long first_ns;          /* when the stage started its first item */
+        long last_ns;           /* and finished its last */
+} stage_stats;
+
+/* Stage 0 is the producers, 1 to transforms are the transform stages
+   and transforms + 1 is the sink */
+typedef struct shared {
+        int transforms;
+        int transform[MAX_STAGES + 2];
+        int workers[MAX_STAGES + 2];
+        unsigned long next_seq;
+        hop hops[MAX_STAGES + 1];
+        stage_stats stats[MAX_STAGES + 2];
+        int late;               /* words the sink gave up waiting for */
+} shared;
+
+/* Transforms */
+#define XF_LOWER   0
+#define XF_UPPER   1
+#define XF_REVERSE 2
+#define XF_HASH    3
+
+static const char *transform_names[] = {"lower", "upper", "reverse", "hash"};
+#define NTRANSFORMS 4
+
+void usage_exit(char *progname)
+{
+        fprintf(stderr,
+                "Usage: %s [-p producers] [-x transform,...] [-w workers,...] "
+                "[-q auto|spsc|mpmc] [-r] "
+                "<event count> <prod interval int> <con interval int>\n"
+                "  <event count> is the number of words each producer queues\n"
+                "  -x lists the transform of each stage: lower, upper, reverse or hash\n"
+                "     (default lower,hash, at most %d stages)\n"
+                "  -w lists the number of workers in each stage (default 1 each)\n"
+                "  -q picks the queue between stages; auto uses SPSC between\n"
+                "     single processes and MPMC everywhere else\n"
+                "  -r makes the sink print words in the order they were produced\n",
+                progname, MAX_STAGES);
+        exit(-1);
+}
+
+void transform_word(int transform, char *word)
+{
+        unsigned int h = 2166136261u;
+        int i, len = strnlen(word, WORDSIZE - 1);
+        char c;
+
+        switch (transform)
+        {
+                case XF_LOWER:
+                        for (i = 0; i < len; i++)
+                                word[i] = tolower((unsigned char) word[i]);
+                        break;
+                case XF_UPPER:
+                        for (i = 0; i < len; i++)
+                                word[i] = toupper((unsigned char) word[i]);
+                        break;
+                case XF_REVERSE:
+                        for (i = 0; i < len / 2; i++)
+                        {
+                                c = word[i];
+                                word[i] = word[len - 1 - i];
+                                word[len - 1 - i] = c;
+                        }
+                        break;
+                case XF_HASH:
+                        /* replace the word with its FNV-1a hash in hex */
+                        for (i = 0; i < len; i++)
+                        {
+                                h ^= (unsigned char) word[i];
+                                h *= 16777619u;
+                        }
+                        snprintf(word, WORDSIZE, "%08x", h);
+                        break;
+        }
+}
+
+void hop_push(hop *h, work_item *it)
+{
+        if (h->spsc)
+                itemq_spsc_push(&h->sq, it);
+        else
+                itemq_mpmc_push(&h->mq, it);
+}
+
+/* Returns -1 once every writer is done and the queue is empty */
+int hop_pop(hop *h, work_item *it)
+{
+        int depth, max;
+
+        /* A rough count is fine for sampling how full the queue is */
+        if (h->spsc)
+                depth = __atomic_load_n(&h->sq.prod_count, __ATOMIC_RELAXED) -
+                        __atomic_load_n(&h->sq.con_count, __ATOMIC_RELAXED);
+        else
+                depth = __atomic_load_n(&h->mq.prod_count, __ATOMIC_RELAXED) -
+                        __atomic_load_n(&h->mq.con_count, __ATOMIC_RELAXED);
+
+        __atomic_add_fetch(&h->occupancy.total, depth, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&h->occupancy.samples, 1, __ATOMIC_RELAXED);
+        max = __atomic_load_n(&h->occupancy.max, __ATOMIC_RELAXED);
+        while (depth > max &&
+               !__atomic_compare_exchange_n(&h->occupancy.max, &max, depth, 0,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                ;
+
+        if (h->spsc)
+                return itemq_spsc_pop(&h->sq, it);
+        return itemq_mpmc_pop(&h->mq, it);
+}
+
+void hop_writer_done(hop *h)
+{
+        if (__atomic_sub_fetch(&h->writers_left, 1, __ATOMIC_ACQ_REL) > 0)
+                return;
+
+        if (h->spsc)
+                itemq_spsc_close(&h->sq);
+        else
+                itemq_mpmc_close(&h->mq);
+}
+
+/* Add one worker's items and time to its stage */
+void stage_done(stage_stats *st, int items, long first_ns, long last_ns)
+{
+        long t;
+
+        __atomic_add_fetch(&st->items, items, __ATOMIC_RELAXED);
+        if (!items)
+                return;
+
+        t = __atomic_load_n(&st->first_ns, __ATOMIC_RELAXED);
+        while ((t == 0 || first_ns < t) &&
+               !__atomic_compare_exchange_n(&st->first_ns, &t, first_ns, 0,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                ;
+        t = __atomic_load_n(&st->last_ns, __ATOMIC_RELAXED);
+        while (last_ns > t &&
+               !__atomic_compare_exchange_n(&st->last_ns, &t, last_ns, 0,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                ;
+}
+
+void producer(shared *s, int event_count, int prod_interval)
+{
+        long first_ns = now_ns();
+        work_item it;
+        int i;
+
+        srandom(getpid());
+
+        for (i=0; i < event_count; i++)
+        {
+                pick_random_word(it.word);
+                it.seq = __atomic_fetch_add(&s->next_seq, 1, __ATOMIC_RELAXED);
+                hop_push(&s->hops[0], &it);
+
+                /* Don't sleep if interval <= 0 */
+                if (prod_interval <= 0)
+                        continue;
+                /* Sleep if we hit our interval */
+                if (i % prod_interval == 0)
+                {
+                        fprintf(stderr, "Producer sleeping for 1 second...\n");
+                        sleep(1);
+                }
+        }
+
+        stage_done(&s->stats[0], event_count, first_ns, now_ns());
+        hop_writer_done(&s->hops[0]);
+        fprintf(stderr, "Producer finished.\n");
+        exit(0);
+}
+
+void worker(shared *s, int stage)
+{
+        long first_ns = 0;
+        work_item it;
+        int n = 0;
+
+        while (hop_pop(&s->hops[stage - 1], &it) == 0)
+        {
+                if (n++ == 0)
+                        first_ns = now_ns();
+                transform_word(s->transform[stage], it.word);
+                hop_push(&s->hops[stage], &it);
+        }
+
+        stage_done(&s->stats[stage], n, first_ns, now_ns());
+        hop_writer_done(&s->hops[stage]);
+        exit(0);
+}
+
+/* Print a word at the sink, sleeping every con_interval words */
+void emit(work_item *it, int *count, int con_interval)
+{
+        output_word((*count)++, it->word);
+
+        /* Don't sleep if interval <= 0 */
+        if (con_interval <= 0)
+                return;
+        /* Sleep if we hit our interval */
+        if ((*count - 1) % con_interval == 0)
+        {
+                fprintf(stderr, "Consumer sleeping for 1 second...\n");
+                sleep(1);
+        }
+}
+
+void sink(shared *s, int con_interval, int reorder)
+{
+        static work_item window[REORDER_WINDOW];
+        static unsigned char held[REORDER_WINDOW];
+        unsigned long next = 0;
+        int slot, count = 0, waiting = 0;
+        long first_ns = 0;
+        work_item it;
+
+        while (hop_pop(&s->hops[s->transforms], &it) == 0)
+        {
+                if (first_ns == 0)
+                        first_ns = now_ns();
+
+                if (!reorder || it.seq < next)
+                {
+                        if (reorder)
+                                s->late++;
+                        emit(&it, &count, con_interval);
+                        continue;
+                }
+
+                /* Window full: stop waiting for the oldest missing words */
+                while (it.seq >= next + REORDER_WINDOW)
+                {
+                        slot = next % REORDER_WINDOW;
+                        if (held[slot])
+                        {
+                                emit(&window[slot], &count, con_interval);
+                                held[slot] = 0;
+                                waiting--;
+                        }
+                        next++;
+                }
+
+                slot = it.seq % REORDER_WINDOW;
+                window[slot] = it;
+                held[slot] = 1;
+                waiting++;
+
+                while (held[next % REORDER_WINDOW])
+                {
+                        slot = next % REORDER_WINDOW;
+                        emit(&window[slot], &count, con_interval);
+                        held[slot] = 0;
+                        waiting--;
+                        next++;
+                }
+        }
+
+        /* Anything still held is waiting on a word that was given up on */
+        for (; waiting > 0; next++)
+        {
+                slot = next % REORDER_WINDOW;
+                if (held[slot])
+                {
+                        emit(&window[slot], &count, con_interval);
+                        held[slot] = 0;
+                        waiting--;
+                }
+        }
+
+        stage_done(&s->stats[s->transforms + 1], count, first_ns, now_ns());
+        fprintf(stderr, "Consumer finished.\n");
+        exit(0);
+}
+
+/* Parse a comma separated list into values, returning how many there were */
+int parse_list(char *arg, int *values, int max, int (*parse)(const char *))
+{
+        char *tok, *save;
+        int n = 0;
+
+        for (tok = strtok_r(arg, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+        {
+                if (n == max)
+                        return -1;
+                if ((values[n++] = parse(tok)) < 0)
+                        return -1;
+        }
+
+        return n;
+}
+
+int parse_transform(const char *name)
+{
+        int i;
+
+        for (i = 0; i < NTRANSFORMS; i++)
+        {
+                if (strcmp(name, transform_names[i]) == 0)
+                        return i;
+        }
+
+        return -1;
+}
+
+int parse_workers(const char *arg)
+{
+        int n = atoi(arg);
+
+        return n >= 1 && n <= MAX_WORKERS ? n : -1;
+}
+
+const char *stage_name(shared *s, int stage)
+{
+        if (stage == 0)
+                return "source";
+        if (stage > s->transforms)
+                return "sink";
+        return transform_names[s->transform[stage]];
+}
+
+void fork_stage(shared *s, int stage, int count, int prod_interval,
+                int con_interval, int reorder)
+{
+        int i;
+
+        for (i = 0; i < s->workers[stage]; i++)
+        {
+                if (fork_or_die() > 0)
+                        continue;
+
+                if (stage == 0)
+                        producer(s, count, prod_interval);
+                else if (stage <= s->transforms)
+                        worker(s, stage);
+                else
+                        sink(s, con_interval, reorder);
+        }
+}
+
+int main(int argc, char *argv[])
+{
+        int count, prod_interval, con_interval;
+        int producers = 1, reorder = 0, kind = HOP_AUTO;
+        int transform[MAX_STAGES] = {XF_LOWER, XF_HASH};
+        int workers[MAX_STAGES] = {1, 1, 1, 1};
+        int transforms = 2, nworkers = 0;
+        int i, opt, processes = 0, failed;
+        struct timespec start, end;
+        stage_stats *st;
+        double secs;
+        hop *h;
+
+        shared *s;
+
+        while ((opt = getopt(argc, argv, "p:x:w:q:r")) != -1)
+        {
+                switch (opt)
+                {
+                        case 'p':
+                                producers = atoi(optarg);
+                                break;
+                        case 'x':
+                                transforms = parse_list(optarg, transform, MAX_STAGES,
+                                                        parse_transform);
+                                break;
+                        case 'w':
+                                nworkers = parse_list(optarg, workers, MAX_STAGES,
+                                                      parse_workers);
+                                if (nworkers < 0)
+                                        usage_exit(argv[0]);
+                                break;
+                        case 'q':
+                                if (strcmp(optarg, "auto") == 0)
+                                        kind = HOP_AUTO;
+                                else if (strcmp(optarg, "spsc") == 0)
+                                        kind = HOP_SPSC;
+                                else if (strcmp(optarg, "mpmc") == 0)
+                                        kind = HOP_MPMC;
+                                else
+                                        usage_exit(argv[0]);
+                                break;
+                        case 'r':
+                                reorder = 1;
+                                break;
+                        default:
+                                usage_exit(argv[0]);
+                }
+        }
+
+        if (transforms < 1 || producers < 1 || producers > MAX_WORKERS)
+        {
+                report_error("Bad transform list or producer count");
+                usage_exit(argv[0]);
+        }
+
+        if (nworkers > transforms)
+        {
+                report_error("More worker counts than stages");
+                usage_exit(argv[0]);
+        }
+
+        if (argc - optind < 3)
+        {
+                report_error("Not enough arguments");
+                usage_exit(argv[0]);
+        }
+
+        count = atoi(argv[optind]);
+        prod_interval = atoi(argv[optind + 1]);
+        con_interval = atoi(argv[optind + 2]);
+
+        s = (shared *) mmap(NULL, sizeof(shared),
+                             PROT_READ|PROT_WRITE,
+                             MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+
+        if (s == MAP_FAILED)
+        {
+                fprintf(stderr, "Error: Unable to mmap: %s\n", strerror(errno));
+                exit(-1);
+        }
+
+        s->transforms = transforms;
+        s->workers[0] = producers;
+        for (i = 1; i <= transforms; i++)
+        {
+                s->transform[i] = transform[i - 1];
+                s->workers[i] = workers[i - 1];
+        }
+        s->workers[transforms + 1] = 1;
+
+        for (i = 0; i <= transforms; i++)
+        {
+                h = &s->hops[i];
+                h->spsc = s->workers[i] == 1 && s->workers[i + 1] == 1;
+                if (kind == HOP_SPSC && !h->spsc)
+                {
+                        fprintf(stderr, "Error: Queue %d has several writers or readers, "
+                                "so it can't be SPSC\n", i);
+                        exit(-1);
+                }
+                if (kind == HOP_MPMC)
+                        h->spsc = 0;
+
+                if (h->spsc)
+                        itemq_spsc_init(&h->sq);
+                else
+                        itemq_mpmc_init(&h->mq);
+                h->writers_left = s->workers[i];
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        /* Start from the sink end so every stage has somebody to take
+           its words as soon as it starts */
+        for (i = transforms + 1; i >= 0; i--)
+        {
+                fork_stage(s, i, count, prod_interval, con_interval, reorder);
+                processes += s->workers[i];
+        }
+
+        failed = reap_children(processes);
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        for (i = 0; i <= transforms + 1; i++)
+        {
+                st = &s->stats[i];
+                secs = (st->last_ns - st->first_ns) / 1e9;
+                fprintf(stderr, "Stage %d (%s, %d process(es)): %d words in %.3f s (%.0f words/s)\n",
+                        i, stage_name(s, i), s->workers[i], st->items, secs,
+                        secs > 0 ? st->items / secs : 0.0);
+        }
+        for (i = 0; i <= transforms; i++)
+        {
+                h = &s->hops[i];
+                fprintf(stderr, "Queue %d (%s, %s -> %s): mean occupancy %.1f of %d, max %d\n",
+                        i, h->spsc ? "spsc" : "mpmc", stage_name(s, i), stage_name(s, i + 1),
+                        h->occupancy.samples ? (double) h->occupancy.total / h->occupancy.samples : 0.0,
+                        QUEUESIZE, h->occupancy.max);
+        }
+
+        secs = elapsed_seconds(&start, &end);
+        fprintf(stderr, "%d producer(s) -> %d stage(s) -> sink: %d produced, %d consumed "
+                "in %.3f s (%.0f words/s)\n",
+                producers, transforms, s->stats[0].items, s->stats[transforms + 1].items,
+                secs, secs > 0 ? s->stats[transforms + 1].items / secs : 0.0);
+        if (reorder)
+                fprintf(stderr, "Reordering: %d word(s) arrived too late to print in order\n",
+                        s->late);
+
+        if (failed)
+        {
+                fprintf(stderr, "Error: %d child process(es) did not exit cleanly\n", failed);
+                return -1;
+        }
+
+        if (s->stats[transforms + 1].items != s->stats[0].items)
+        {
+                report_error("Sink did not get every word");
+                return -1;
+        }
+
+        return 0;
+}
@@ -31,65 +31,23 @@
 #include <pthread.h>
 #include <semaphore.h>
 
-#define QUEUESIZE 32
-#define WORDSIZE 16
+#include "words.h"
+#include "proc.h"
 
-const int wordlist_size = 27;
-const char *wordlist[] = {
-        "Alpha",
-        "Bravo",
-        "Charlie",
-        "Delta",
-        "Echo",
-        "Foxtrot",
-        "Golf",
-        "Hotel",
-        "India",
-        "Juliet",
-        "Kilo",
-        "Lima",
-        "Mike",
-        "November",
-        "Oscar",
-        "Papa",
-        "Quebec",
-        "Romeo",
-        "Sierra",
-        "Tango",
-        "Uniform",
-        "Victor",
-        "Whiskey",
-        "X-ray",
-        "Yankee",
-        "Zulu",
-        "Dash"
-};
+#define QUEUESIZE 32
 
-typedef struct entry {
-        char word[WORDSIZE];
-        sem_t lock;
-} entry;
+#define QUEUE_NAME     wordq
+#define QUEUE_TYPE     word_t
+#define QUEUE_CAPACITY QUEUESIZE
+#define QUEUE_POLICY   QUEUE_SPSC
+#include "queue.h"
 
 typedef struct shared {
-        pthread_mutex_t nonempty_mutex;
-        pthread_mutex_t nonfull_mutex;
-        pthread_cond_t  queue_nonempty;
-        pthread_cond_t  queue_nonfull;
-        entry queue[QUEUESIZE];
-        int last_produced;
-        int last_consumed;
+        wordq queue;
         pid_t prod_pid;
         pid_t con_pid;
-        int prod_count;
-        int con_count;
 } shared;
 
-
-void report_error(char *error)
-{
-        fprintf(stderr, "Error: %s\n", error);
-}
-
 void usage_exit(char *progname)
 {
         fprintf(stderr,
@@ -98,137 +56,16 @@ void usage_exit(char *progname)
         exit(-1);
 }
 
-void pick_word(char *word)
-{
-        unsigned int pick;
-
-        /* Open /dev/urandom for reading */
-        int fd = open("/dev/urandom", O_RDONLY);
-        if (fd < 0)
-        {
-                fprintf(stderr, "Error: Unable to open /dev/urandom for reading: %s\n", strerror(errno));
-                pick = 0;
-        }
-        else if (read(fd, (void *)&pick, sizeof(pick)) == -1)
-        {
-                fprintf(stderr, "Error: Unable to read from /dev/urandom: %s\n",strerror(errno));
-                pick = 0;
-        }
-
-        pick = pick % wordlist_size;
-
-        strcpy(word, wordlist[pick]);
-
-        close(fd);
-}
-
-void wait_for_producer(shared *s)
-{
-        fprintf(stderr, "Waiting for producer...\n");
-        pthread_mutex_lock(&s->nonempty_mutex);
-        pthread_cond_wait(&s->queue_nonempty, &s->nonempty_mutex);
-        pthread_mutex_unlock(&s->nonempty_mutex);
-}
-
-void wait_for_consumer(shared *s)
-{
-        fprintf(stderr, "Waiting for consumer...\n");
-        pthread_mutex_lock(&s->nonfull_mutex);
-        pthread_cond_wait(&s->queue_nonfull, &s->nonfull_mutex);
-        pthread_mutex_unlock(&s->nonfull_mutex);
-}
-
-void output_word(int c, char *w)
-{
-        printf("Word %d: %s\n", c, w);
-}
-
+/* Waits for room, so it can't fail */
 int queue_word(char *word, shared *s)
 {
-        entry *e;
-        int current, retval;
-
-        current = (s->last_produced + 1) % QUEUESIZE;
-
-        e = &s->queue[current];
-
-        sem_wait(&e->lock);
-
-        if (e->word[0] != '\0')
-        {
-                /* consumer hasn't consumed this entry yet */
-                sem_post(&e->lock);
-                wait_for_consumer(s);
-                sem_wait(&e->lock);
-        }
-
-        if (e->word[0] != '\0')
-        {
-                fprintf(stderr, "ERROR: No room for producer after waiting!\n");
-                retval = -1;
-                goto done;
-        }
-        else
-        {
-                strncpy(e->word, word, WORDSIZE);
-                s->last_produced = current;
-                s->prod_count++;
-                retval = 0;
-                goto done;
-        }
-
- done:
-        sem_post(&e->lock);
-        /* Notify that queue is nonempty */
-        pthread_mutex_lock(&s->nonempty_mutex);
-        pthread_cond_signal(&s->queue_nonempty);
-        pthread_mutex_unlock(&s->nonempty_mutex);
-
-        return retval;
+        return wordq_push(&s->queue, (const word_t *) word);
 }
 
+/* Waits for a word; the queue is never closed here, so neither can this */
 int get_next_word(char *word, shared *s)
 {
-        entry *e;
-        int current, retval;
-
-        current = (s->last_consumed + 1) % QUEUESIZE;
-
-        e = &s->queue[current];
-
-        sem_wait(&e->lock);
-
-        if (e->word[0] == '\0')
-        {
-                /* producer hasn't filled in this entry yet */
-                sem_post(&e->lock);
-                wait_for_producer(s);
-                sem_wait(&e->lock);
-        }
-
-        if (e->word[0] == '\0')
-        {
-                fprintf(stderr, "ERROR: Nothing for consumer after waiting!\n");
-                retval = -1;
-                goto done;
-        }
-        else
-        {
-                strncpy(word, e->word, WORDSIZE);
-                e->word[0] = '\0';
-                s->last_consumed = current;
-                s->con_count++;
-                retval = 0;
-                goto done;
-        }
-
- done:
-        sem_post(&e->lock);
-        /* Notify that queue is nonfull */
-        pthread_mutex_lock(&s->nonfull_mutex);
-        pthread_cond_signal(&s->queue_nonfull);
-        pthread_mutex_unlock(&s->nonfull_mutex);
-        return retval;
+        return wordq_pop(&s->queue, (word_t *) word);
 }
 
 void producer(shared *s, int event_count, int prod_interval)
@@ -264,7 +101,7 @@ void consumer(shared *s, int event_count, int con_interval)
         for (i=0; i < event_count; i++)
         {
                 get_next_word(word, s);
-                output_word(s->con_count, word);
+                output_word(s->queue.con_count, word);
 
                 /* Don't sleep if interval <= 0 */
                 if (con_interval <= 0)
@@ -283,42 +120,10 @@ void consumer(shared *s, int event_count, int con_interval)
 
 void init_shared(shared *s)
 {
-        int i;
-
-        pthread_mutexattr_t mattr;
-        pthread_condattr_t cattr;
-
-        /* We need to explicitly mark the mutex as shared or
-           risk undefined behavior */
-        pthread_mutexattr_init(&mattr);
-        //pthread_mutexattr_settype(&mattr, PTHREAD_MUTEX_ERRORCHECK_NP);
-        pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
-        pthread_mutex_init(&s->nonempty_mutex, &mattr);
-        pthread_mutex_init(&s->nonfull_mutex, &mattr);
-
-        /* We need to explicitly mark the conditions as shared or
-           risk undefined behavior */
-        pthread_condattr_init(&cattr);
-        pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
-        pthread_cond_init(&s->queue_nonempty, &cattr);
-        pthread_cond_init(&s->queue_nonfull, &cattr);
-
-        s->last_consumed = -1;
-        s->last_produced = -1;
+        wordq_init(&s->queue);
 
         s->prod_pid = -1;
         s->con_pid  = -1;
-
-        s->prod_count = 0;
-        s->con_count  = 0;
-
-        for (i=0; i<QUEUESIZE; i++)
-        {
-                s->queue[i].word[0] = '\0';
-                /* semaphore is shared between processes,
-                   and initial value is 1 (unlocked) */
-                sem_init(&s->queue[i].lock, 1, 1);
-        }
 }
 
 int main(int argc, char *argv[])
@@ -357,7 +162,7 @@ int main(int argc, char *argv[])
 
         init_shared(s);
 
-        pid = fork();
+        pid = fork_or_die();
 
         if (pid == 0)
         {
@@ -30,185 +30,97 @@
 #include <sys/types.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <time.h>
 
+#include "words.h"
+#include "proc.h"
+
+/* Override with e.g. -DQUEUESIZE=65536 for a bigger ring */
+#ifndef QUEUESIZE
 #define QUEUESIZE 32
-#define WORDSIZE 16
-
-const int wordlist_size = 27;
-const char *wordlist[] = {
-        "Alpha",
-        "Bravo",
-        "Charlie",
-        "Delta",
-        "Echo",
-        "Foxtrot",
-        "Golf",
-        "Hotel",
-        "India",
-        "Juliet",
-        "Kilo",
-        "Lima",
-        "Mike",
-        "November",
-        "Oscar",
-        "Papa",
-        "Quebec",
-        "Romeo",
-        "Sierra",
-        "Tango",
-        "Uniform",
-        "Victor",
-        "Whiskey",
-        "X-ray",
-        "Yankee",
-        "Zulu",
-        "Dash"
-};
-
-typedef struct entry {
-        char word[WORDSIZE];
-        sem_t lock;
-} entry;
+#endif
+
+#define QUEUE_NAME     wordq
+#define QUEUE_TYPE     word_t
+#define QUEUE_CAPACITY QUEUESIZE
+#define QUEUE_POLICY   QUEUE_SPSC
+#include "queue.h"
+
+/* Identifies a journal file written by this program; the low byte is
+   the layout version, to be bumped whenever shared changes */
+#define JOURNAL_MAGIC 0x33303002
 
 typedef struct shared {
-        pthread_mutex_t nonfull_mutex;
-        pthread_mutex_t nonempty_mutex;
-        pthread_cond_t  queue_nonempty;
-        pthread_cond_t  queue_nonfull;
-        entry queue[QUEUESIZE];
-        int last_produced;
-        int last_consumed;
+        unsigned int magic;
+        unsigned int size;      /* sizeof(shared) when it was written */
+        wordq queue;
+        int overflow;           /* what queue_word does when the queue is full */
+        int timeout_ms;
         pid_t prod_pid;
         pid_t con_pid;
-        int prod_count;
-        int con_count;
 } shared;
 
-
-void report_error(char *error)
-{
-        fprintf(stderr, "Error: %s\n", error);
-}
+/* Per-process state for the optional file-backed (journal) mode */
+typedef struct journal {
+        int fd;                 /* -1 when the ring is anonymous memory */
+        int sync_records;       /* sync after this many words, 0 = never */
+        int sync_interval_ms;   /* sync after this much time, 0 = never */
+        int pending;            /* words since the last sync */
+        long last_sync_ns;
+} journal;
 
 void usage_exit(char *progname)
 {
         fprintf(stderr,
-                "Usage: %s <event count> <prod interval int> <con interval int>\n",
+                "Usage: %s [-f journal file] [-b sync records] [-i sync interval ms] "
+                "[-o block|timeout:<ms>|drop|overwrite] [-d] "
+                "<event count> <prod interval int> <con interval int>\n",
                 progname);
         exit(-1);
 }
 
-void pick_word(char *word)
-{
-        unsigned int pick;
-
-        /* Open /dev/urandom for reading */
-        int fd = open("/dev/urandom", O_RDONLY);
-        if (fd < 0)
-        {
-                fprintf(stderr, "Error: Unable to open /dev/urandom for reading: %s\n", strerror(errno));
-                pick = 0;
-        }
-        else if (read(fd, (void *)&pick, sizeof(pick)) == -1)
-        {
-                fprintf(stderr, "Error: Unable to read from /dev/urandom: %s\n",strerror(errno));
-                pick = 0;
-        }
-
-        pick = pick % wordlist_size;
-
-        strcpy(word, wordlist[pick]);
-
-        close(fd);
-}
-
-void wait_for_producer(shared *s)
-{
-        fprintf(stderr, "Waiting for producer...\n");
-        pthread_mutex_lock(&s->nonempty_mutex);
-        pthread_cond_wait(&s->queue_nonempty, &s->nonempty_mutex);
-        pthread_mutex_unlock(&s->nonempty_mutex);
-}
-
-void wait_for_consumer(shared *s)
+/* Returns non-zero if the word was dropped or timed out */
+int queue_word(char *word, shared *s)
 {
-        fprintf(stderr, "Waiting for consumer...\n");
-        pthread_mutex_lock(&s->nonfull_mutex);
-        pthread_cond_wait(&s->queue_nonfull, &s->nonfull_mutex);
-        pthread_mutex_unlock(&s->nonfull_mutex);
+        return wordq_offer(&s->queue, (const word_t *) word, s->overflow, s->timeout_ms);
 }
 
-void output_word(int c, char *w)
+/* Returns -1 once the producer has finished and the queue is empty */
+int get_next_word(char *word, shared *s)
 {
-        printf("Word %d: %s\n", c, w);
+        return wordq_pop(&s->queue, (word_t *) word);
 }
 
-int queue_word(char *word, shared *s)
+/* Takes every word that is ready, up to max, with a single wakeup of the
+ * producer. Returns how many were taken, or -1 like get_next_word. */
+int get_next_words(word_t *words, int max, shared *s)
 {
-        entry *e;
-        int current;
-
-        current = (s->last_produced + 1) % QUEUESIZE;
-        e = &s->queue[current];
-        sem_wait(&e->lock);
-
-        while (e->word[0] != '\0')
-        {
-                /* consumer hasn't consumed this entry yet */
-                sem_post(&e->lock);
-                wait_for_consumer(s);
-                sem_wait(&e->lock);
-                current = (s->last_produced + 1) % QUEUESIZE;
-                e = &s->queue[current];
-        }
-
-        strncpy(e->word, word, WORDSIZE);
-        s->last_produced = current;
-        s->prod_count++;
-
-        /* Notify that queue is nonempty */
-        pthread_mutex_lock(&s->nonempty_mutex);
-        pthread_cond_signal(&s->queue_nonempty);
-        pthread_mutex_unlock(&s->nonempty_mutex);
-
-        sem_post(&e->lock);
-        return 0;
+        return wordq_drain(&s->queue, words, max < QUEUESIZE ? max : QUEUESIZE);
 }
 
-int get_next_word(char *word, shared *s)
+/* Flush the ring and its cursors to the journal file.
+ * Syncs are batched so their cost is paid once per sync_records words
+ * or sync_interval_ms milliseconds rather than once per word. */
+void journal_sync(shared *s, journal *j, int records, int force)
 {
-        entry *e;
-        int current;
-
-        current = (s->last_consumed + 1) % QUEUESIZE;
-        e = &s->queue[current];
-        sem_wait(&e->lock);
+        if (j->fd < 0)
+                return;
 
-        if (e->word[0] == '\0')
-        {
-                /* producer hasn't filled in this entry yet */
-                sem_post(&e->lock);
-                wait_for_producer(s);
-                sem_wait(&e->lock);
-                current = (s->last_consumed + 1) % QUEUESIZE;
-                e = &s->queue[current];
-        }
+        j->pending += records;
 
-        strncpy(word, e->word, WORDSIZE);
-        e->word[0] = '\0';
-        s->last_consumed = current;
-        s->con_count++;
+        if (!force &&
+            (j->sync_records <= 0 || j->pending < j->sync_records) &&
+            (j->sync_interval_ms <= 0 || (now_ns() - j->last_sync_ns) / 1000000 < j->sync_interval_ms))
+                return;
 
-        /* Notify that queue is nonfull */
-        pthread_mutex_lock(&s->nonfull_mutex);
-        pthread_cond_signal(&s->queue_nonfull);
-        pthread_mutex_unlock(&s->nonfull_mutex);
+        if (msync(s, sizeof(shared), MS_SYNC) == -1)
+                fprintf(stderr, "Error: Unable to msync journal: %s\n", strerror(errno));
 
-        sem_post(&e->lock);
-        return 0;
+        j->pending = 0;
+        j->last_sync_ns = now_ns();
 }
 
-void producer(shared *s, int event_count, int prod_interval)
+void producer(shared *s, journal *j, int event_count, int prod_interval)
 {
         char word[WORDSIZE];
         int i;
@@ -217,6 +129,7 @@ void producer(shared *s, int event_count, int prod_interval)
         {
                 pick_word(word);
                 queue_word(word, s);
+                journal_sync(s, j, 1, 0);
 
                 /* Don't sleep if interval <= 0 */
                 if (prod_interval <= 0)
@@ -229,117 +142,252 @@ void producer(shared *s, int event_count, int prod_interval)
                 }
         }
 
+        wordq_close(&s->queue);
+        journal_sync(s, j, 0, 1);
+        if (s->overflow != QUEUE_BLOCK)
+                queue_report_overflow(&s->queue.overflow);
         fprintf(stderr, "Producer finished.\n");
         exit(0);
 }
 
-void consumer(shared *s, int event_count, int con_interval)
+void consumer(shared *s, journal *j, int event_count, int con_interval, int drain)
 {
-        char word[WORDSIZE];
-        int i;
+        word_t words[QUEUESIZE];
+        int i, k, n;
 
-        for (i=0; i < event_count; i++)
+        for (i=0; i < event_count; )
         {
-                get_next_word(word, s);
-                output_word(s->con_count, word);
+                if (drain)
+                        n = get_next_words(words, event_count - i, s);
+                else
+                        n = get_next_word(words[0], s) == 0 ? 1 : -1;
+                if (n < 0)
+                        break;
+                journal_sync(s, j, n, 0);
 
-                /* Don't sleep if interval <= 0 */
-                if (con_interval <= 0)
-                        continue;
-                /* Sleep if we hit our interval */
-                if (i % con_interval == 0)
+                for (k=0; k < n; k++, i++)
                 {
-                        fprintf(stderr, "Consumer sleeping for 1 second...\n");
-                        sleep(1);
+                        output_word(s->queue.con_count - n + k + 1, words[k]);
+
+                        /* Don't sleep if interval <= 0 */
+                        if (con_interval <= 0)
+                                continue;
+                        /* Sleep if we hit our interval */
+                        if (i % con_interval == 0)
+                        {
+                                fprintf(stderr, "Consumer sleeping for 1 second...\n");
+                                sleep(1);
+                        }
                 }
         }
 
+        journal_sync(s, j, 0, 1);
+        queue_report_wakeups(&s->queue.wakeups);
         fprintf(stderr, "Consumer finished.\n");
         exit(0);
 }
 
 void init_shared(shared *s)
 {
-        int i;
-
-        /* We need to explicitly mark the mutex as shared or risk undefined behavior */
-        pthread_mutexattr_t mattr = {};
-        pthread_mutexattr_setpshared(&mattr, 1);
-        pthread_mutex_init(&s->nonfull_mutex, &mattr);
-        pthread_mutex_init(&s->nonempty_mutex, &mattr);
+        s->magic = JOURNAL_MAGIC;
+        s->size = sizeof(shared);
 
-        /* We need to explicitly mark the conditions as shared or risk undefined behavior */
-        pthread_condattr_t cattr = {};
-        pthread_condattr_setpshared(&cattr, 1);
-        pthread_cond_init(&s->queue_nonempty, &cattr);
-        pthread_cond_init(&s->queue_nonfull, &cattr);
+        wordq_init(&s->queue);
 
-        s->last_consumed = -1;
-        s->last_produced = -1;
+        s->overflow = QUEUE_BLOCK;
+        s->timeout_ms = 0;
 
         s->prod_pid = -1;
         s->con_pid  = -1;
+}
+
+/* Rebuild a ring left behind by an earlier run. The locks may have been
+ * held by a process that died, so they are reinitialized. The cursors are
+ * recomputed from the slots themselves, since a crash between syncs can
+ * persist a slot without its cursor (or the reverse): the filled slots
+ * always form one contiguous run, and that run is what gets replayed.
+ * Returns the number of words recovered. */
+int recover_shared(shared *s)
+{
+        wordq *q = &s->queue;
+        int i, start = -1, filled = 0;
 
-        s->prod_count = 0;
-        s->con_count  = 0;
+        wordq_init_sync(q);
 
         for (i=0; i<QUEUESIZE; i++)
         {
-                s->queue[i].word[0] = '\0';
-                /* semaphore is shared between processes,
-                   and initial value is 1 (unlocked) */
-                sem_init(&s->queue[i].lock, 1, 1);
+                if (!(q->state[i] & QUEUE_SLOT_FULL))
+                        continue;
+                filled++;
+                if (!(q->state[(i + QUEUESIZE - 1) % QUEUESIZE] & QUEUE_SLOT_FULL))
+                        start = i;
+        }
+
+        if (filled == 0)
+        {
+                /* keep the persisted cursors, just make them agree */
+                q->last_produced = q->last_consumed;
+        }
+        else if (filled < QUEUESIZE)
+        {
+                q->last_consumed = (start + QUEUESIZE - 1) % QUEUESIZE;
+                q->last_produced = (start + filled - 1) % QUEUESIZE;
         }
+        else
+        {
+                /* ring is completely full, trust the consumer's cursor */
+                q->last_produced = q->last_consumed;
+        }
+
+        q->prod_count = 0;
+        q->con_count  = 0;
+        q->closed = 0;
+
+        s->prod_pid = -1;
+        s->con_pid  = -1;
+
+        return filled;
 }
 
-int main(int argc, char *argv[])
+/* Map the journal file as the ring, creating it if needed. A file from
+ * another version of this program is started afresh rather than
+ * recovered. *recovered is set to the number of words replayed. */
+shared *map_journal(char *path, journal *j, int *recovered)
 {
-        int pid, count, prod_interval, con_interval;
-
+        struct stat st;
         shared *s;
+        int fresh;
 
-        if (argc < 4)
+        j->fd = open(path, O_RDWR|O_CREAT, 0644);
+        if (j->fd < 0)
         {
-                if (argc < 1)
-                {
-                        report_error("no command line");
-                        usage_exit(argv[0]);
-                }
-                else
-                {
-                        report_error("Not enough arguments");
-                        usage_exit(argv[0]);
-                }
+                fprintf(stderr, "Error: Unable to open %s: %s\n", path, strerror(errno));
+                exit(-1);
         }
 
-        count = atoi(argv[1]);
-        prod_interval = atoi(argv[2]);
-        con_interval = atoi(argv[3]);
+        if (fstat(j->fd, &st) == -1)
+        {
+                fprintf(stderr, "Error: Unable to stat %s: %s\n", path, strerror(errno));
+                exit(-1);
+        }
+
+        fresh = (st.st_size != sizeof(shared));
+        if (fresh && ftruncate(j->fd, sizeof(shared)) == -1)
+        {
+                fprintf(stderr, "Error: Unable to size %s: %s\n", path, strerror(errno));
+                exit(-1);
+        }
 
         s = (shared *) mmap(NULL, sizeof(shared),
                              PROT_READ|PROT_WRITE,
-                             MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+                             MAP_SHARED, j->fd, 0);
 
         if (s == MAP_FAILED)
         {
-                fprintf(stderr, "Error: Unable to mmap: %s\n", strerror(errno));
+                fprintf(stderr, "Error: Unable to mmap %s: %s\n", path, strerror(errno));
                 exit(-1);
         }
 
-        init_shared(s);
+        *recovered = 0;
+        if (fresh || s->magic != JOURNAL_MAGIC || s->size != sizeof(shared))
+        {
+                init_shared(s);
+        }
+        else
+        {
+                *recovered = recover_shared(s);
+                fprintf(stderr, "Recovered %d word(s) from %s\n", *recovered, path);
+        }
+
+        j->last_sync_ns = now_ns();
+        journal_sync(s, j, 0, 1);
+
+        return s;
+}
+
+int main(int argc, char *argv[])
+{
+        int pid, count, prod_interval, con_interval, opt, recovered = 0;
+        int overflow = QUEUE_BLOCK, timeout_ms = 0, drain = 0;
+        char *journal_path = NULL;
+        journal j = { .fd = -1 };
+
+        shared *s;
+
+        while ((opt = getopt(argc, argv, "f:b:i:o:d")) != -1)
+        {
+                switch (opt)
+                {
+                        case 'f':
+                                journal_path = optarg;
+                                break;
+                        case 'b':
+                                j.sync_records = atoi(optarg);
+                                break;
+                        case 'i':
+                                j.sync_interval_ms = atoi(optarg);
+                                break;
+                        case 'o':
+                                if (queue_parse_overflow(optarg, &overflow, &timeout_ms, NULL))
+                                        usage_exit(argv[0]);
+                                break;
+                        case 'd':
+                                drain = 1;
+                                break;
+                        default:
+                                usage_exit(argv[0]);
+                }
+        }
+
+        if (argc - optind < 3)
+        {
+                report_error("Not enough arguments");
+                usage_exit(argv[0]);
+        }
+
+        count = atoi(argv[optind]);
+        prod_interval = atoi(argv[optind + 1]);
+        con_interval = atoi(argv[optind + 2]);
+
+        if (journal_path)
+        {
+                s = map_journal(journal_path, &j, &recovered);
+        }
+        else
+        {
+                s = (shared *) mmap(NULL, sizeof(shared),
+                                     PROT_READ|PROT_WRITE,
+                                     MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+
+                if (s == MAP_FAILED)
+                {
+                        fprintf(stderr, "Error: Unable to mmap: %s\n", strerror(errno));
+                        exit(-1);
+                }
+
+                init_shared(s);
+        }
+
+        s->overflow = overflow;
+        s->timeout_ms = timeout_ms;
+
+        fprintf(stderr, "Ring: %d slots x %zu bytes (%zu word + %zu state), %zu byte segment\n",
+                QUEUESIZE, wordq_slot_bytes(), sizeof(word_t),
+                wordq_slot_bytes() - sizeof(word_t), sizeof(shared));
 
-        pid = fork();
+        pid = fork_or_die();
 
         if (pid == 0)
         {
                 /* Producer */
                 s->prod_pid = getpid();
-                producer(s, count, prod_interval);
+                producer(s, &j, count, prod_interval);
         } else
         {
-                /* Consumer */
+                /* Consumer; the recovered words come out ahead of the
+                   new ones, so they count towards what it has to take */
                 s->con_pid = getpid();
-                consumer(s, count, con_interval);
+                consumer(s, &j, count + recovered, con_interval, drain);
         }
 
         /* This line should never be reached */
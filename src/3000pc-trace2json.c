@@ -0,0 +1,118 @@
+/* 3000pc-trace2json.c  Convert a binary 3000pc trace to Chrome trace JSON
+ * Copyright (C) 2020  William Findlay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+/* You really shouldn't be incorporating parts of this in any other code,
+   it is meant for teaching, not production */
+
+/* Reads a file written by trace_dump() (see trace.h) and prints the JSON
+ * trace event format understood by chrome://tracing and ui.perfetto.dev.
+ * Each process gets its own track. Waits become duration events that end
+ * when the process wakes; everything else is an instant event. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+
+#include "trace.h"
+
+void usage_exit(char *progname)
+{
+        fprintf(stderr, "Usage: %s <trace file> > trace.json\n", progname);
+        exit(-1);
+}
+
+const char *event_name(int type)
+{
+        switch (type)
+        {
+                case TRACE_ENQUEUE:       return "enqueue";
+                case TRACE_DEQUEUE:       return "dequeue";
+                case TRACE_WAIT_PRODUCER: return "wait for producer";
+                case TRACE_WAIT_CONSUMER: return "wait for consumer";
+                case TRACE_SEND:          return "send";
+                case TRACE_RECV:          return "recv";
+                default:                  return "unknown";
+        }
+}
+
+int main(int argc, char *argv[])
+{
+        trace_header h;
+        trace_record *recs;
+        uint64_t first = UINT64_MAX;
+        const char *arg;
+        double ts;
+        uint32_t i;
+        FILE *f;
+
+        if (argc < 2)
+                usage_exit(argv[0]);
+
+        f = fopen(argv[1], "r");
+        if (!f)
+        {
+                fprintf(stderr, "Error: Unable to open %s: %s\n", argv[1], strerror(errno));
+                exit(-1);
+        }
+
+        if (fread(&h, sizeof(h), 1, f) != 1 || h.magic != TRACE_MAGIC)
+        {
+                fprintf(stderr, "Error: %s is not a 3000pc trace\n", argv[1]);
+                exit(-1);
+        }
+
+        recs = malloc(h.records * sizeof(trace_record) + 1);
+        if (!recs || fread(recs, sizeof(trace_record), h.records, f) != h.records)
+        {
+                fprintf(stderr, "Error: Unable to read %u records from %s\n", h.records, argv[1]);
+                exit(-1);
+        }
+        fclose(f);
+
+        /* Timestamps are shown relative to the earliest record */
+        for (i = 0; i < h.records; i++)
+        {
+                if (recs[i].tsc < first)
+                        first = recs[i].tsc;
+        }
+
+        printf("{\"traceEvents\":[\n");
+        for (i = 0; i < h.records; i++)
+        {
+                ts = (recs[i].tsc - first) / h.ticks_per_us;
+                arg = recs[i].type == TRACE_SEND || recs[i].type == TRACE_RECV ? "count" : "slot";
+
+                if (recs[i].type == TRACE_WOKE)
+                        printf("{\"ph\":\"E\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+                               ts, recs[i].pid, recs[i].pid);
+                else
+                        printf("{\"name\":\"%s\",\"ph\":\"%s\",%s\"ts\":%.3f,\"pid\":%d,\"tid\":%d,"
+                               "\"args\":{\"%s\":%u}}",
+                               event_name(recs[i].type),
+                               recs[i].type == TRACE_WAIT_PRODUCER ||
+                               recs[i].type == TRACE_WAIT_CONSUMER ? "B" : "i",
+                               recs[i].type == TRACE_WAIT_PRODUCER ||
+                               recs[i].type == TRACE_WAIT_CONSUMER ? "" : "\"s\":\"t\",",
+                               ts, recs[i].pid, recs[i].pid, arg, recs[i].slot);
+                printf(i + 1 < h.records ? ",\n" : "\n");
+        }
+        printf("],\"displayTimeUnit\":\"ns\"}\n");
+
+        free(recs);
+        return 0;
+}
@@ -0,0 +1,212 @@
+/* broadcast.h  Single-producer broadcast ring in shared memory
+ * Copyright (C) 2020  William Findlay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+/* You really shouldn't be incorporating parts of this in any other code,
+   it is meant for teaching, not production */
+
+/* Unlike queue.h, where each item goes to exactly one consumer, every
+ * reader of a broadcast ring sees every item. Like queue.h this header is
+ * a template; define the following and then include it:
+ *
+ *   BCAST_NAME      prefix for the generated type and functions
+ *   BCAST_TYPE      element type, copied in and out with memcpy
+ *   BCAST_CAPACITY  number of slots, a compile time constant
+ *
+ * There is one writer. It never waits for readers and never copies an
+ * item more than once, so its cost doesn't depend on how many readers
+ * there are. Each reader keeps its own cursor (a bcast_reader) in private
+ * memory.
+ *
+ * Each slot has a sequence number, seqlock style: odd while the writer is
+ * filling it in, and 2 * (position + 1) once item number position is in
+ * place. A reader copies the item and then checks the sequence number was
+ * the one it expected both before and after the copy. If the writer has
+ * lapped a reader, the reader counts the items it missed and skips ahead
+ * to the oldest item still in the ring. */
+
+#ifndef BROADCAST_H
+#define BROADCAST_H
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+typedef struct bcast_reader {
+        unsigned long next;     /* position of the next item to read */
+        unsigned long received;
+        unsigned long lost;     /* items overwritten before we read them */
+} bcast_reader;
+
+#define BCAST_CAT_(a, b) a##_##b
+#define BCAST_CAT(a, b) BCAST_CAT_(a, b)
+
+#endif /* BROADCAST_H */
+
+#if !defined(BCAST_NAME) || !defined(BCAST_TYPE) || !defined(BCAST_CAPACITY)
+#error "BCAST_NAME, BCAST_TYPE and BCAST_CAPACITY must be defined before including broadcast.h"
+#endif
+
+#define BCAST_FN(fn) BCAST_CAT(BCAST_NAME, fn)
+
+typedef struct BCAST_NAME {
+        pthread_mutex_t mutex;
+        pthread_cond_t  nonempty;
+        int waiters;            /* readers waiting for the writer */
+        int closed;
+        unsigned long head;     /* position of the next item to write */
+        unsigned long seq[BCAST_CAPACITY];
+        BCAST_TYPE items[BCAST_CAPACITY];
+} BCAST_NAME;
+
+static inline void BCAST_FN(init)(BCAST_NAME *b)
+{
+        pthread_mutexattr_t mattr;
+        pthread_condattr_t cattr;
+
+        /* We need to explicitly mark the mutex as shared or
+           risk undefined behavior */
+        pthread_mutexattr_init(&mattr);
+        pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+        pthread_mutex_init(&b->mutex, &mattr);
+        pthread_mutexattr_destroy(&mattr);
+
+        /* We need to explicitly mark the conditions as shared or
+           risk undefined behavior */
+        pthread_condattr_init(&cattr);
+        pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+        pthread_cond_init(&b->nonempty, &cattr);
+        pthread_condattr_destroy(&cattr);
+
+        b->waiters = 0;
+        b->closed = 0;
+        b->head = 0;
+        memset(b->seq, 0, sizeof(b->seq));
+}
+
+/* Start reading from the oldest item still in the ring */
+static inline void BCAST_FN(subscribe)(BCAST_NAME *b, bcast_reader *r)
+{
+        unsigned long head = __atomic_load_n(&b->head, __ATOMIC_ACQUIRE);
+
+        r->next = head > BCAST_CAPACITY ? head - BCAST_CAPACITY : 0;
+        r->received = 0;
+        r->lost = 0;
+}
+
+/* Wake readers, but only if any are asleep (see queue.h) */
+static inline void BCAST_FN(notify)(BCAST_NAME *b)
+{
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&b->waiters, __ATOMIC_RELAXED))
+                return;
+
+        pthread_mutex_lock(&b->mutex);
+        pthread_cond_broadcast(&b->nonempty);
+        pthread_mutex_unlock(&b->mutex);
+}
+
+static inline void BCAST_FN(publish)(BCAST_NAME *b, const BCAST_TYPE *item)
+{
+        unsigned long pos = b->head;
+        int current = pos % BCAST_CAPACITY;
+
+        __atomic_store_n(&b->seq[current], 2 * pos + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        memcpy(&b->items[current], item, sizeof(BCAST_TYPE));
+        __atomic_store_n(&b->seq[current], 2 * (pos + 1), __ATOMIC_RELEASE);
+        __atomic_store_n(&b->head, pos + 1, __ATOMIC_RELEASE);
+
+        BCAST_FN(notify)(b);
+}
+
+/* No more items will be published */
+static inline void BCAST_FN(close)(BCAST_NAME *b)
+{
+        pthread_mutex_lock(&b->mutex);
+        __atomic_store_n(&b->closed, 1, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&b->nonempty);
+        pthread_mutex_unlock(&b->mutex);
+}
+
+static inline void BCAST_FN(wait_for_writer)(BCAST_NAME *b, bcast_reader *r)
+{
+        pthread_mutex_lock(&b->mutex);
+        __atomic_add_fetch(&b->waiters, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&b->head, __ATOMIC_ACQUIRE) <= r->next &&
+               !__atomic_load_n(&b->closed, __ATOMIC_ACQUIRE))
+                pthread_cond_wait(&b->nonempty, &b->mutex);
+        __atomic_sub_fetch(&b->waiters, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&b->mutex);
+}
+
+/* Returns 0 with the next item in *item, or -1 once the ring is closed
+ * and the reader has caught up */
+static inline int BCAST_FN(read)(BCAST_NAME *b, bcast_reader *r, BCAST_TYPE *item)
+{
+        unsigned long head, before, after, expected;
+        int current;
+
+        for (;;)
+        {
+                head = __atomic_load_n(&b->head, __ATOMIC_ACQUIRE);
+                if (r->next >= head)
+                {
+                        /* re-check head after seeing closed, since the last
+                           item may have been published just before the close */
+                        if (__atomic_load_n(&b->closed, __ATOMIC_ACQUIRE) &&
+                            r->next >= __atomic_load_n(&b->head, __ATOMIC_ACQUIRE))
+                                return -1;
+                        BCAST_FN(wait_for_writer)(b, r);
+                        continue;
+                }
+
+                if (head - r->next > BCAST_CAPACITY)
+                {
+                        /* lapped: everything before head - CAPACITY is gone */
+                        r->lost += head - BCAST_CAPACITY - r->next;
+                        r->next = head - BCAST_CAPACITY;
+                }
+
+                current = r->next % BCAST_CAPACITY;
+                expected = 2 * (r->next + 1);
+
+                before = __atomic_load_n(&b->seq[current], __ATOMIC_ACQUIRE);
+                memcpy(item, &b->items[current], sizeof(BCAST_TYPE));
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                after = __atomic_load_n(&b->seq[current], __ATOMIC_RELAXED);
+
+                if (before == expected && after == expected)
+                        break;
+
+                /* the writer got to this slot first; go around again and
+                   let the lapped check above skip us forward */
+                if (after > expected)
+                {
+                        r->lost++;
+                        r->next++;
+                }
+        }
+
+        r->next++;
+        r->received++;
+        return 0;
+}
+
+#undef BCAST_FN
+#undef BCAST_NAME
+#undef BCAST_TYPE
+#undef BCAST_CAPACITY
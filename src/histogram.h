@@ -0,0 +1,132 @@
+/* histogram.h  Per-consumer word counts that merge without a shared lock
+ * Copyright (C) 2020  William Findlay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+/* You really shouldn't be incorporating parts of this in any other code,
+   it is meant for teaching, not production */
+
+/* A word_histogram counts how often each wordlist entry was seen, with one
+ * extra bucket for words that aren't in wordlist. Each process counts into
+ * its own private histogram, so the hot path is a hash and an increment;
+ * histogram_merge() then adds it into a histogram in shared memory with
+ * atomic adds, once at shutdown (or as often as the caller likes).
+ *
+ * Words are looked up by hashing all 16 bytes of the NUL padded word into
+ * a 256 entry table built by histogram_init(). For the current wordlist
+ * the hash happens to be perfect, so a lookup is one probe and one 16 byte
+ * compare; should the list change, colliding words just probe on. */
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "words.h"
+
+/* wordlist_size + 1, rounded up */
+#define HISTOGRAM_BUCKETS 32
+#define HISTOGRAM_HASHSIZE 256
+
+typedef struct word_histogram {
+        long counts[HISTOGRAM_BUCKETS];
+} word_histogram;
+
+/* wordlist index + 1 for each hash slot, 0 when empty */
+static unsigned char histogram_table[HISTOGRAM_HASHSIZE];
+
+static inline unsigned int histogram_hash(const char *word)
+{
+        uint64_t a, b;
+
+        memcpy(&a, word, sizeof(a));
+        memcpy(&b, word + sizeof(a), sizeof(b));
+        return ((a ^ b) * 0x9E3779B97F4A7C15ULL) >> 56;
+}
+
+static inline void histogram_init(void)
+{
+        unsigned int h;
+        int i;
+
+        memset(histogram_table, 0, sizeof(histogram_table));
+        for (i = 0; i < wordlist_size && i < HISTOGRAM_BUCKETS - 1; i++)
+        {
+                h = histogram_hash(wordlist[i]);
+                while (histogram_table[h])
+                        h = (h + 1) % HISTOGRAM_HASHSIZE;
+                histogram_table[h] = i + 1;
+        }
+}
+
+/* Index of word in wordlist, or wordlist_size if it isn't there */
+static inline int histogram_index(const char *word)
+{
+        unsigned int h = histogram_hash(word);
+        int i;
+
+        while ((i = histogram_table[h]))
+        {
+                if (memcmp(wordlist[i - 1], word, WORDSIZE) == 0)
+                        return i - 1;
+                h = (h + 1) % HISTOGRAM_HASHSIZE;
+        }
+
+        return wordlist_size;
+}
+
+static inline void histogram_count(word_histogram *hist, const char *word)
+{
+        hist->counts[histogram_index(word)]++;
+}
+
+/* Add a private histogram into a shared one; safe to call from any number
+   of processes at once */
+static inline void histogram_merge(word_histogram *shared, const word_histogram *local)
+{
+        int i;
+
+        for (i = 0; i <= wordlist_size; i++)
+        {
+                if (local->counts[i])
+                        __atomic_add_fetch(&shared->counts[i], local->counts[i], __ATOMIC_RELAXED);
+        }
+}
+
+static inline long histogram_total(const word_histogram *hist)
+{
+        long total = 0;
+        int i;
+
+        for (i = 0; i <= wordlist_size; i++)
+                total += hist->counts[i];
+
+        return total;
+}
+
+/* Prints the counts four to a line, with the words not in wordlist last */
+static inline void histogram_report(const char *label, const word_histogram *hist)
+{
+        int i;
+
+        fprintf(stderr, "%s:\n", label);
+        for (i = 0; i < wordlist_size; i++)
+                fprintf(stderr, "  %-10s %9ld%s", wordlist[i], hist->counts[i],
+                        i % 4 == 3 ? "\n" : "");
+        fprintf(stderr, "%s  %-10s %9ld\n", i % 4 ? "\n" : "", "(other)", hist->counts[i]);
+}
+
+#endif /* HISTOGRAM_H */
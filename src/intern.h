@@ -0,0 +1,139 @@
+/* intern.h  Table of interned words shared between processes
+ * Copyright (C) 2020  William Findlay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+/* You really shouldn't be incorporating parts of this in any other code,
+   it is meant for teaching, not production */
+
+/* Instead of copying a whole WORDSIZE word through a queue, a producer can
+ * intern it once and send its one byte id. The consumer turns the id back
+ * into a word only when it needs the text.
+ *
+ * The table lives in shared memory. Entries are never changed or removed
+ * once added, so lookups don't take the lock; only adding a new word does. */
+
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <string.h>
+#include <pthread.h>
+
+#include "words.h"
+
+#define INTERN_MAX 256
+/* Hash buckets, a power of two comfortably larger than INTERN_MAX */
+#define INTERN_BUCKETS 512
+/* Stored words keep their NUL, so only this much of a word is its key;
+   hashing, comparing and storing all stop here */
+#define INTERN_KEYLEN (WORDSIZE - 1)
+
+typedef unsigned char word_id;
+
+typedef struct intern_table {
+        pthread_mutex_t lock;
+        int count;
+        /* bucket holds id + 1 so that zero means empty */
+        unsigned short buckets[INTERN_BUCKETS];
+        word_t words[INTERN_MAX];
+} intern_table;
+
+static inline unsigned int intern_hash(const char *word)
+{
+        unsigned int h = 2166136261u;
+        int i;
+
+        /* FNV-1a */
+        for (i = 0; i < INTERN_KEYLEN && word[i]; i++)
+        {
+                h ^= (unsigned char) word[i];
+                h *= 16777619u;
+        }
+
+        return h;
+}
+
+/* Returns the id of word, or -1 if it hasn't been interned */
+static inline int intern_find(intern_table *t, const char *word)
+{
+        unsigned int b = intern_hash(word) & (INTERN_BUCKETS - 1);
+        int id;
+
+        while ((id = __atomic_load_n(&t->buckets[b], __ATOMIC_ACQUIRE)) != 0)
+        {
+                if (strncmp(t->words[id - 1], word, INTERN_KEYLEN) == 0)
+                        return id - 1;
+                b = (b + 1) & (INTERN_BUCKETS - 1);
+        }
+
+        return -1;
+}
+
+/* Returns the id of word, adding it to the table if needed,
+ * or -1 if the table is full */
+static inline int intern(intern_table *t, const char *word)
+{
+        unsigned int b;
+        size_t len;
+        int id;
+
+        if ((id = intern_find(t, word)) >= 0)
+                return id;
+
+        pthread_mutex_lock(&t->lock);
+
+        /* someone may have added it while we waited for the lock */
+        if ((id = intern_find(t, word)) >= 0 || t->count == INTERN_MAX)
+                goto done;
+
+        id = t->count++;
+        len = strnlen(word, INTERN_KEYLEN);
+        memcpy(t->words[id], word, len);
+        memset(t->words[id] + len, 0, WORDSIZE - len);
+
+        b = intern_hash(word) & (INTERN_BUCKETS - 1);
+        while (t->buckets[b] != 0)
+                b = (b + 1) & (INTERN_BUCKETS - 1);
+        /* publish only after the word itself is in place */
+        __atomic_store_n(&t->buckets[b], id + 1, __ATOMIC_RELEASE);
+
+ done:
+        pthread_mutex_unlock(&t->lock);
+        return id;
+}
+
+static inline char *intern_word(intern_table *t, word_id id)
+{
+        return t->words[id];
+}
+
+/* Start with wordlist already interned, so word ids match wordlist indices */
+static inline void intern_init(intern_table *t)
+{
+        pthread_mutexattr_t mattr;
+        int i;
+
+        pthread_mutexattr_init(&mattr);
+        pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+        pthread_mutex_init(&t->lock, &mattr);
+        pthread_mutexattr_destroy(&mattr);
+
+        t->count = 0;
+        memset(t->buckets, 0, sizeof(t->buckets));
+
+        for (i = 0; i < wordlist_size; i++)
+                intern(t, wordlist[i]);
+}
+
+#endif /* INTERN_H */
@@ -0,0 +1,402 @@
+/* lanes.h  Multi-lane priority queue in shared memory
+ * Copyright (C) 2020  William Findlay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+/* You really shouldn't be incorporating parts of this in any other code,
+   it is meant for teaching, not production */
+
+/* With one FIFO, an urgent item waits behind everything already queued.
+ * This queue has up to LANES_MAX lanes, each with its own ring, lane 0
+ * being the most urgent. Producers push to a lane; consumers pop from
+ * whichever lane the selection policy picks:
+ *
+ *   LANES_STRICT  always the most urgent lane with anything in it. A less
+ *                 urgent lane that has been passed over starve_limit times
+ *                 in a row gets the next pop, so it still gets at least
+ *                 one pop in starve_limit + 1 (0 turns this off).
+ *   LANES_WRR     weighted round robin: up to weight[i] pops from lane i
+ *                 in turn, skipping empty lanes. Every lane gets its turn
+ *                 each round, so nothing starves.
+ *
+ * Like queue.h this header is a template; define the following and then
+ * include it:
+ *
+ *   LANES_NAME      prefix for the generated type and functions
+ *   LANES_TYPE      element type, copied in and out with memcpy
+ *   LANES_CAPACITY  number of slots in each lane, a compile time constant
+ *
+ * The number of lanes, policy and weights are set at init() time. One
+ * mutex covers every lane, since a consumer has to look at all of them to
+ * choose; a full lane only blocks producers of that lane, each of which
+ * waits on its own lane's condition.
+ *
+ * Every item is stamped when push() is called, so each lane's statistics
+ * have the latency from then to when pop() hands the item over, as a mean,
+ * a maximum and a power of two histogram for percentiles, along with the
+ * depth of the lane after each push. lanes_report() prints them. */
+
+#ifndef LANES_H
+#define LANES_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "proc.h"
+
+#define LANES_MAX 8
+
+#define LANES_STRICT 0
+#define LANES_WRR    1
+
+/* Latency histogram bucket i counts latencies below 2^i ns */
+#define LANES_LAT_BUCKETS 40
+
+/* Written under the queue mutex */
+typedef struct lane_stats {
+        long pushed;
+        long popped;
+        long depth_total;       /* summed after each push, for the mean */
+        int max_depth;
+        long promoted;          /* pops it got from starvation protection */
+        long lat_total_ns;
+        long lat_max_ns;
+        long lat_buckets[LANES_LAT_BUCKETS];
+} lane_stats;
+
+static inline const char *lanes_policy_name(int policy)
+{
+        return policy == LANES_WRR ? "wrr" : "strict";
+}
+
+/* Parse "strict" or "wrr" */
+static inline int lanes_parse_policy(const char *arg, int *policy)
+{
+        if (strcmp(arg, "strict") == 0)
+                *policy = LANES_STRICT;
+        else if (strcmp(arg, "wrr") == 0)
+                *policy = LANES_WRR;
+        else
+                return -1;
+
+        return 0;
+}
+
+/* Parse comma separated weights, each at least 1; returns how many */
+static inline int lanes_parse_weights(const char *arg, int weights[LANES_MAX])
+{
+        const char *p = arg;
+        char *end;
+        int n = 0;
+        long w;
+
+        while (n < LANES_MAX)
+        {
+                w = strtol(p, &end, 10);
+                if (end == p || w < 1)
+                        return -1;
+                weights[n++] = w;
+                if (*end == '\0')
+                        return n;
+                if (*end != ',')
+                        return -1;
+                p = end + 1;
+        }
+
+        return -1;
+}
+
+static inline void lanes_record_latency(lane_stats *st, long ns)
+{
+        int bucket = 0;
+
+        while (bucket < LANES_LAT_BUCKETS - 1 && (1L << bucket) <= ns)
+                bucket++;
+
+        st->popped++;
+        st->lat_total_ns += ns;
+        if (ns > st->lat_max_ns)
+                st->lat_max_ns = ns;
+        st->lat_buckets[bucket]++;
+}
+
+/* Upper bound, in microseconds, of the bucket holding the pct'th
+   percentile, or the maximum if that is lower */
+static inline double lanes_percentile_us(lane_stats *st, double pct)
+{
+        long seen = 0, want = st->popped * pct / 100;
+        int i;
+
+        for (i = 0; i < LANES_LAT_BUCKETS - 1; i++)
+        {
+                seen += st->lat_buckets[i];
+                if (seen > want)
+                        break;
+        }
+
+        if (i == LANES_LAT_BUCKETS - 1 || (1L << i) > st->lat_max_ns)
+                return st->lat_max_ns / 1e3;
+        return (1L << i) / 1e3;
+}
+
+/* One line per lane */
+static inline void lanes_report(lane_stats *stats, const int *weights, int nlanes,
+                                int policy, int starve_limit)
+{
+        lane_stats *st;
+        int i;
+
+        fprintf(stderr, "Lanes (%s", lanes_policy_name(policy));
+        if (policy == LANES_STRICT)
+                fprintf(stderr, ", starvation limit %d", starve_limit);
+        fprintf(stderr, "): lane, weight, words, mean/max depth, "
+                "latency mean / p50 / p99 / max us, promoted\n");
+
+        for (i = 0; i < nlanes; i++)
+        {
+                st = &stats[i];
+                fprintf(stderr, "  %d %3d %9ld %7.2f / %3d %10.1f / %8.1f / %8.1f / %10.1f %7ld\n",
+                        i, weights[i], st->popped,
+                        st->pushed ? (double) st->depth_total / st->pushed : 0.0,
+                        st->max_depth,
+                        st->popped ? st->lat_total_ns / 1e3 / st->popped : 0.0,
+                        lanes_percentile_us(st, 50), lanes_percentile_us(st, 99),
+                        st->lat_max_ns / 1e3, st->promoted);
+        }
+}
+
+#define LANES_CAT_(a, b) a##_##b
+#define LANES_CAT(a, b) LANES_CAT_(a, b)
+
+#endif /* LANES_H */
+
+#if !defined(LANES_NAME) || !defined(LANES_TYPE) || !defined(LANES_CAPACITY)
+#error "LANES_NAME, LANES_TYPE and LANES_CAPACITY must be defined before including lanes.h"
+#endif
+
+#define LANES_FN(fn) LANES_CAT(LANES_NAME, fn)
+
+typedef struct LANES_FN(lane) {
+        int head;               /* next slot to pop */
+        int count;
+        int skipped;            /* pops that passed it over while it had items */
+        int nonfull_waiters;
+        pthread_cond_t nonfull;
+        long stamp[LANES_CAPACITY];     /* when each item was pushed */
+        LANES_TYPE items[LANES_CAPACITY];
+        lane_stats stats;
+} LANES_FN(lane);
+
+typedef struct LANES_NAME {
+        pthread_mutex_t mutex;
+        pthread_cond_t nonempty;
+        int nonempty_waiters;
+        int queued;             /* items in all lanes together */
+        int closed;
+        int nlanes;
+        int policy;
+        int starve_limit;
+        int weights[LANES_MAX];
+        int cursor;             /* LANES_WRR: lane whose turn it is */
+        int credit;             /* ... and pops it has left this turn */
+        LANES_FN(lane) lanes[LANES_MAX];
+} LANES_NAME;
+
+/* weights may be NULL for 2^(nlanes - 1 - i), so each lane gets twice
+   the turns of the one after it */
+static inline void LANES_FN(init)(LANES_NAME *q, int nlanes, int policy,
+                                  const int *weights, int starve_limit)
+{
+        pthread_mutexattr_t mattr;
+        pthread_condattr_t cattr;
+        int i;
+
+        memset(q, 0, sizeof(*q));
+
+        /* We need to explicitly mark the mutex as shared or
+           risk undefined behavior */
+        pthread_mutexattr_init(&mattr);
+        pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+        pthread_mutex_init(&q->mutex, &mattr);
+        pthread_mutexattr_destroy(&mattr);
+
+        /* We need to explicitly mark the conditions as shared or
+           risk undefined behavior */
+        pthread_condattr_init(&cattr);
+        pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+        pthread_cond_init(&q->nonempty, &cattr);
+        for (i = 0; i < LANES_MAX; i++)
+                pthread_cond_init(&q->lanes[i].nonfull, &cattr);
+        pthread_condattr_destroy(&cattr);
+
+        q->nlanes = nlanes < 1 ? 1 : nlanes > LANES_MAX ? LANES_MAX : nlanes;
+        q->policy = policy;
+        q->starve_limit = starve_limit;
+        for (i = 0; i < q->nlanes; i++)
+                q->weights[i] = weights ? weights[i] : 1 << (q->nlanes - 1 - i);
+        q->credit = q->weights[0];
+}
+
+/* Blocks while the lane is full. Returns -1 if lane is out of range. */
+static inline int LANES_FN(push)(LANES_NAME *q, int lane, const LANES_TYPE *item)
+{
+        long now = now_ns();
+        LANES_FN(lane) *l;
+        int slot;
+
+        if (lane < 0 || lane >= q->nlanes)
+                return -1;
+        l = &q->lanes[lane];
+
+        pthread_mutex_lock(&q->mutex);
+        while (l->count == LANES_CAPACITY)
+        {
+                l->nonfull_waiters++;
+                pthread_cond_wait(&l->nonfull, &q->mutex);
+                l->nonfull_waiters--;
+        }
+
+        slot = (l->head + l->count) % LANES_CAPACITY;
+        memcpy(&l->items[slot], item, sizeof(LANES_TYPE));
+        l->stamp[slot] = now;
+        l->count++;
+        q->queued++;
+
+        l->stats.pushed++;
+        l->stats.depth_total += l->count;
+        if (l->count > l->stats.max_depth)
+                l->stats.max_depth = l->count;
+
+        if (q->nonempty_waiters)
+                pthread_cond_signal(&q->nonempty);
+        pthread_mutex_unlock(&q->mutex);
+
+        return 0;
+}
+
+/* No more items will be pushed; consumers drain what is left */
+static inline void LANES_FN(close)(LANES_NAME *q)
+{
+        pthread_mutex_lock(&q->mutex);
+        q->closed = 1;
+        pthread_cond_broadcast(&q->nonempty);
+        pthread_mutex_unlock(&q->mutex);
+}
+
+/* Called with the mutex held and at least one item queued */
+static inline int LANES_FN(select_strict)(LANES_NAME *q)
+{
+        int first = -1, chosen = -1, i;
+
+        for (i = 0; i < q->nlanes; i++)
+        {
+                if (!q->lanes[i].count)
+                        continue;
+                if (first < 0)
+                        first = chosen = i;
+                else if (chosen == first && q->starve_limit &&
+                         q->lanes[i].skipped >= q->starve_limit)
+                        chosen = i;
+        }
+
+        for (i = 0; i < q->nlanes; i++)
+        {
+                if (i != chosen && q->lanes[i].count)
+                        q->lanes[i].skipped++;
+        }
+        q->lanes[chosen].skipped = 0;
+        if (chosen != first)
+                q->lanes[chosen].stats.promoted++;
+
+        return chosen;
+}
+
+/* Called with the mutex held and at least one item queued */
+static inline int LANES_FN(select_wrr)(LANES_NAME *q)
+{
+        int i;
+
+        if (q->credit <= 0 || !q->lanes[q->cursor].count)
+        {
+                /* next lane with anything in it, coming back round to
+                   this one last */
+                for (i = 1; i <= q->nlanes; i++)
+                {
+                        if (q->lanes[(q->cursor + i) % q->nlanes].count)
+                                break;
+                }
+                q->cursor = (q->cursor + i) % q->nlanes;
+                q->credit = q->weights[q->cursor];
+        }
+
+        q->credit--;
+        return q->cursor;
+}
+
+/* Returns the lane the item in *item came from, or -1 once the queue is
+ * closed and every lane is empty */
+static inline int LANES_FN(pop)(LANES_NAME *q, LANES_TYPE *item)
+{
+        LANES_FN(lane) *l;
+        int lane;
+
+        pthread_mutex_lock(&q->mutex);
+        while (!q->queued)
+        {
+                if (q->closed)
+                {
+                        pthread_mutex_unlock(&q->mutex);
+                        return -1;
+                }
+                q->nonempty_waiters++;
+                pthread_cond_wait(&q->nonempty, &q->mutex);
+                q->nonempty_waiters--;
+        }
+
+        if (q->policy == LANES_WRR)
+                lane = LANES_FN(select_wrr)(q);
+        else
+                lane = LANES_FN(select_strict)(q);
+        l = &q->lanes[lane];
+
+        memcpy(item, &l->items[l->head], sizeof(LANES_TYPE));
+        lanes_record_latency(&l->stats, now_ns() - l->stamp[l->head]);
+        l->head = (l->head + 1) % LANES_CAPACITY;
+        l->count--;
+        q->queued--;
+
+        if (l->nonfull_waiters)
+                pthread_cond_signal(&l->nonfull);
+        pthread_mutex_unlock(&q->mutex);
+
+        return lane;
+}
+
+static inline void LANES_FN(report)(LANES_NAME *q)
+{
+        lane_stats stats[LANES_MAX];
+        int i;
+
+        for (i = 0; i < q->nlanes; i++)
+                stats[i] = q->lanes[i].stats;
+        lanes_report(stats, q->weights, q->nlanes, q->policy, q->starve_limit);
+}
+
+#undef LANES_FN
+#undef LANES_NAME
+#undef LANES_TYPE
+#undef LANES_CAPACITY
@@ -0,0 +1,198 @@
+/* perf.h  perf_event counters around the producer and consumer loops
+ * Copyright (C) 2020  William Findlay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+/* You really shouldn't be incorporating parts of this in any other code,
+   it is meant for teaching, not production */
+
+/* Each process opens its own counters with perf_open(), brackets its loop
+ * with perf_start() and perf_stop(), and adds what it counted to a
+ * perf_totals in shared memory with perf_add(). The parent then reports
+ * each total per message with perf_report().
+ *
+ * Many VMs have no hardware counters. When the cycle counter can't be
+ * opened we count the software task clock (nanoseconds on the CPU)
+ * instead; the other hardware events are just reported as unavailable.
+ * Context switches and page faults are software events and work anywhere
+ * perf_event_open does.
+ *
+ * If perf_event_paranoid stops us counting in the kernel we fall back to
+ * counting user space only, which misses the time spent in system calls. */
+
+#ifndef PERF_H
+#define PERF_H
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define PERF_CYCLES       0
+#define PERF_INSTRUCTIONS 1
+#define PERF_CACHE_MISSES 2
+#define PERF_LLC_MISSES   3
+#define PERF_CSWITCHES    4
+#define PERF_PAGE_FAULTS  5
+#define PERF_NEVENTS      6
+
+/* What was counted for each event, kept in perf_totals */
+#define PERF_UNAVAILABLE 0
+#define PERF_COUNTED     1
+#define PERF_FALLBACK    2
+
+typedef struct perf_event {
+        const char *name;
+        unsigned int type;
+        unsigned long long config;
+        /* software event to count instead, if fallback_name is set */
+        const char *fallback_name;
+        unsigned long long fallback_config;
+} perf_event;
+
+static const perf_event perf_events[PERF_NEVENTS] = {
+        {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES,
+         "task-clock ns", PERF_COUNT_SW_TASK_CLOCK},
+        {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, NULL, 0},
+        {"cache misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, NULL, 0},
+        {"LLC misses", PERF_TYPE_HW_CACHE,
+         PERF_COUNT_HW_CACHE_LL |
+         (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), NULL, 0},
+        {"context switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, NULL, 0},
+        {"page faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, NULL, 0},
+};
+
+/* One process's open counters */
+typedef struct perf_counters {
+        int fd[PERF_NEVENTS];
+        int what[PERF_NEVENTS];
+} perf_counters;
+
+/* Sums over every process on one side, in shared memory */
+typedef struct perf_totals {
+        long value[PERF_NEVENTS];
+        int what[PERF_NEVENTS];
+        int processes;
+} perf_totals;
+
+static inline int perf_open_one(unsigned int type, unsigned long long config)
+{
+        struct perf_event_attr attr;
+        int fd;
+
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_hv = 1;
+
+        /* this process only, on whatever CPU it runs */
+        fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fd == -1)
+        {
+                attr.exclude_kernel = 1;
+                fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+
+        return fd;
+}
+
+static inline void perf_open(perf_counters *pc)
+{
+        const perf_event *e;
+        int i;
+
+        for (i = 0; i < PERF_NEVENTS; i++)
+        {
+                e = &perf_events[i];
+                pc->what[i] = PERF_COUNTED;
+                pc->fd[i] = perf_open_one(e->type, e->config);
+                if (pc->fd[i] == -1 && e->fallback_name)
+                {
+                        pc->what[i] = PERF_FALLBACK;
+                        pc->fd[i] = perf_open_one(PERF_TYPE_SOFTWARE, e->fallback_config);
+                }
+                if (pc->fd[i] == -1)
+                        pc->what[i] = PERF_UNAVAILABLE;
+        }
+}
+
+static inline void perf_start(perf_counters *pc)
+{
+        int i;
+
+        for (i = 0; i < PERF_NEVENTS; i++)
+        {
+                if (pc->fd[i] == -1)
+                        continue;
+                ioctl(pc->fd[i], PERF_EVENT_IOC_RESET, 0);
+                ioctl(pc->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+}
+
+static inline void perf_stop(perf_counters *pc)
+{
+        int i;
+
+        for (i = 0; i < PERF_NEVENTS; i++)
+        {
+                if (pc->fd[i] != -1)
+                        ioctl(pc->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+        }
+}
+
+/* Add this process's counts to t and close the counters */
+static inline void perf_add(perf_counters *pc, perf_totals *t)
+{
+        long long value;
+        int i;
+
+        for (i = 0; i < PERF_NEVENTS; i++)
+        {
+                if (pc->fd[i] == -1)
+                        continue;
+                if (read(pc->fd[i], &value, sizeof(value)) == sizeof(value))
+                {
+                        __atomic_add_fetch(&t->value[i], (long) value, __ATOMIC_RELAXED);
+                        __atomic_store_n(&t->what[i], pc->what[i], __ATOMIC_RELAXED);
+                }
+                close(pc->fd[i]);
+        }
+
+        __atomic_add_fetch(&t->processes, 1, __ATOMIC_RELAXED);
+}
+
+static inline void perf_report(const char *side, perf_totals *t, int messages)
+{
+        const perf_event *e;
+        int i;
+
+        fprintf(stderr, "%s counters per message (%d process(es)):\n", side, t->processes);
+        for (i = 0; i < PERF_NEVENTS; i++)
+        {
+                e = &perf_events[i];
+                if (t->what[i] == PERF_UNAVAILABLE)
+                        fprintf(stderr, "  %-18s n/a\n", e->name);
+                else
+                        fprintf(stderr, "  %-18s %.3f\n",
+                                t->what[i] == PERF_FALLBACK ? e->fallback_name : e->name,
+                                messages ? (double) t->value[i] / messages : 0.0);
+        }
+}
+
+#endif /* PERF_H */
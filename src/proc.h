@@ -0,0 +1,88 @@
+/* proc.h  Timing and child process helpers shared by the programs
+ * Copyright (C) 2020  William Findlay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+/* You really shouldn't be incorporating parts of this in any other code,
+   it is meant for teaching, not production */
+
+/* Every program forks its producers and consumers, waits for them and
+ * times the run, so the helpers for that live here. All times are on
+ * CLOCK_MONOTONIC, which keeps going while a process sleeps and is the
+ * same clock in every process, so timestamps can be compared across a
+ * fork(). */
+
+#ifndef PROC_H
+#define PROC_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+static inline long now_ns(void)
+{
+        struct timespec t;
+
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+static inline double elapsed_seconds(struct timespec *start, struct timespec *end)
+{
+        return (end->tv_sec - start->tv_sec) +
+                (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* fork(), giving up on the whole program if it fails */
+static inline pid_t fork_or_die(void)
+{
+        pid_t pid = fork();
+
+        if (pid < 0)
+        {
+                fprintf(stderr, "Error: Unable to fork: %s\n", strerror(errno));
+                exit(-1);
+        }
+
+        return pid;
+}
+
+/* Wait for every child and return the number that did not exit cleanly */
+static inline int reap_children(int children)
+{
+        int status, failed = 0;
+
+        while (children > 0)
+        {
+                if (wait(&status) < 0)
+                {
+                        if (errno == EINTR)
+                                continue;
+                        fprintf(stderr, "Error: Unable to wait for children: %s\n", strerror(errno));
+                        return failed + children;
+                }
+                if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                        failed++;
+                children--;
+        }
+
+        return failed;
+}
+
+#endif /* PROC_H */
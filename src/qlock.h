@@ -0,0 +1,351 @@
+/* qlock.h  Process-shared queue lock with per-process contention statistics
+ * Copyright (C) 2020  William Findlay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+/* You really shouldn't be incorporating parts of this in any other code,
+   it is meant for teaching, not production */
+
+/* A qlock is a lock for shared memory that is either
+ *
+ *   QLOCK_MUTEX   a process-shared pthread mutex, which makes no promise
+ *                 about who gets it next, or
+ *   QLOCK_TICKET  a ticket lock: each locker takes the next ticket and
+ *                 waits for it to be served, so the lock is handed out in
+ *                 strict arrival order and nobody can be starved.
+ *
+ * The kind is picked at qlock_init() time, so a program can offer both.
+ * A qcond is a condition to wait on while holding a qlock, like a
+ * pthread_cond_t; for a ticket lock it is a futex sequence number.
+ *
+ * Ticket waiters yield a few times and then sleep on the serving counter
+ * with FUTEX_WAIT_BITSET, using their ticket (mod 32) as the bitset, so
+ * unlocking wakes only whoever holds the next ticket instead of every
+ * waiter. As in queue.h, a count of sleepers lets unlock skip the wake
+ * system call when nobody is asleep.
+ *
+ * Every acquisition is timed. Each process records its own acquisitions,
+ * time spent waiting for the lock and time spent holding it in its own
+ * entry of l->stats, indexed by qlock_self, which each process must set
+ * with qlock_set_self() after fork(). qlock_report() prints them, so the
+ * spread between processes shows how fair the lock was. */
+
+#ifndef QLOCK_H
+#define QLOCK_H
+
+#include <stdio.h>
+#include <limits.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "proc.h"
+
+#define QLOCK_MUTEX  0
+#define QLOCK_TICKET 1
+
+/* Processes that get their own statistics; the rest share the last entry */
+#define QLOCK_MAX_PROCS 64
+/* Yields before a ticket waiter goes to sleep */
+#define QLOCK_SPINS 8
+
+typedef struct qlock_stats {
+        long acquisitions;
+        long wait_ns;
+        long max_wait_ns;
+        long hold_ns;
+        long held_since;        /* while this process holds the lock */
+} __attribute__((aligned(64))) qlock_stats;
+
+typedef struct qlock {
+        int kind;
+        pthread_mutex_t mutex;                  /* QLOCK_MUTEX */
+        unsigned int next;                      /* QLOCK_TICKET: next ticket to hand out */
+        unsigned int serving __attribute__((aligned(64)));     /* ... and the one that holds it */
+        int sleepers;
+        qlock_stats stats[QLOCK_MAX_PROCS];
+} qlock;
+
+typedef struct qcond {
+        pthread_cond_t cond;                    /* QLOCK_MUTEX */
+        unsigned int seq;                       /* QLOCK_TICKET */
+} qcond;
+
+/* This process's entry in the statistics */
+static int qlock_self;
+
+static inline void qlock_set_self(int k)
+{
+        qlock_self = k < QLOCK_MAX_PROCS ? k : QLOCK_MAX_PROCS - 1;
+}
+
+static inline const char *qlock_name(int kind)
+{
+        return kind == QLOCK_TICKET ? "ticket" : "mutex";
+}
+
+/* Parse "mutex" or "ticket" */
+static inline int qlock_parse(const char *arg, int *kind)
+{
+        if (strcmp(arg, "mutex") == 0)
+                *kind = QLOCK_MUTEX;
+        else if (strcmp(arg, "ticket") == 0)
+                *kind = QLOCK_TICKET;
+        else
+                return -1;
+
+        return 0;
+}
+
+/* Process-shared futexes, so not FUTEX_PRIVATE_FLAG. Absolute timeouts
+   are on CLOCK_MONOTONIC. */
+static inline int qlock_futex_wait(unsigned int *addr, unsigned int val,
+                                   const struct timespec *deadline, unsigned int bits)
+{
+        return syscall(SYS_futex, addr, FUTEX_WAIT_BITSET, val, deadline, NULL, bits);
+}
+
+static inline void qlock_futex_wake(unsigned int *addr, int n, unsigned int bits)
+{
+        syscall(SYS_futex, addr, FUTEX_WAKE_BITSET, n, NULL, NULL, bits);
+}
+
+static inline void qlock_init(qlock *l, int kind)
+{
+        pthread_mutexattr_t mattr;
+
+        memset(l, 0, sizeof(*l));
+        l->kind = kind;
+
+        pthread_mutexattr_init(&mattr);
+        pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+        pthread_mutex_init(&l->mutex, &mattr);
+        pthread_mutexattr_destroy(&mattr);
+}
+
+static inline void qcond_init(qcond *c)
+{
+        pthread_condattr_t cattr;
+
+        pthread_condattr_init(&cattr);
+        pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+        pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+        pthread_cond_init(&c->cond, &cattr);
+        pthread_condattr_destroy(&cattr);
+
+        c->seq = 0;
+}
+
+static inline unsigned int qlock_bit(unsigned int ticket)
+{
+        return 1u << (ticket % 32);
+}
+
+/* Take the lock without touching the statistics */
+static inline void qlock_acquire(qlock *l)
+{
+        unsigned int ticket, serving;
+        int spins = 0;
+
+        if (l->kind == QLOCK_MUTEX)
+        {
+                pthread_mutex_lock(&l->mutex);
+                return;
+        }
+
+        ticket = __atomic_fetch_add(&l->next, 1, __ATOMIC_RELAXED);
+        while ((serving = __atomic_load_n(&l->serving, __ATOMIC_ACQUIRE)) != ticket)
+        {
+                if (++spins < QLOCK_SPINS)
+                {
+                        sched_yield();
+                        continue;
+                }
+
+                /* Announce ourselves before the last look, so that
+                   unlock either sees us or we see its new value */
+                __atomic_add_fetch(&l->sleepers, 1, __ATOMIC_RELAXED);
+                __atomic_thread_fence(__ATOMIC_SEQ_CST);
+                serving = __atomic_load_n(&l->serving, __ATOMIC_RELAXED);
+                if (serving != ticket)
+                        qlock_futex_wait(&l->serving, serving, NULL, qlock_bit(ticket));
+                __atomic_sub_fetch(&l->sleepers, 1, __ATOMIC_RELAXED);
+        }
+}
+
+static inline void qlock_release(qlock *l)
+{
+        unsigned int serving;
+
+        if (l->kind == QLOCK_MUTEX)
+        {
+                pthread_mutex_unlock(&l->mutex);
+                return;
+        }
+
+        serving = __atomic_add_fetch(&l->serving, 1, __ATOMIC_RELEASE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&l->sleepers, __ATOMIC_RELAXED))
+                qlock_futex_wake(&l->serving, INT_MAX, qlock_bit(serving));
+}
+
+static inline void qlock_acquired(qlock *l, long since)
+{
+        qlock_stats *st = &l->stats[qlock_self];
+        long now = now_ns();
+
+        st->acquisitions++;
+        st->wait_ns += now - since;
+        if (now - since > st->max_wait_ns)
+                st->max_wait_ns = now - since;
+        st->held_since = now;
+}
+
+static inline void qlock_lock(qlock *l)
+{
+        long since = now_ns();
+
+        qlock_acquire(l);
+        qlock_acquired(l, since);
+}
+
+/* Returns 0 if we got the lock, EBUSY if somebody else has it */
+static inline int qlock_trylock(qlock *l)
+{
+        unsigned int serving;
+        long since = now_ns();
+
+        if (l->kind == QLOCK_MUTEX)
+        {
+                if (pthread_mutex_trylock(&l->mutex) != 0)
+                        return EBUSY;
+        }
+        else
+        {
+                /* the lock is free when the next ticket would be served straight away */
+                serving = __atomic_load_n(&l->serving, __ATOMIC_RELAXED);
+                if (!__atomic_compare_exchange_n(&l->next, &serving, serving + 1, 0,
+                                                 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                        return EBUSY;
+        }
+
+        qlock_acquired(l, since);
+        return 0;
+}
+
+static inline void qlock_unlock(qlock *l)
+{
+        qlock_stats *st = &l->stats[qlock_self];
+
+        st->hold_ns += now_ns() - st->held_since;
+        qlock_release(l);
+}
+
+/* Called with l held; returns ETIMEDOUT if deadline (when not NULL)
+ * passes first. The time asleep counts as neither waiting for nor
+ * holding the lock, and getting it back isn't another acquisition. */
+static inline int qcond_wait(qcond *c, qlock *l, const struct timespec *deadline)
+{
+        qlock_stats *st = &l->stats[qlock_self];
+        unsigned int seq;
+        int ret = 0;
+
+        st->hold_ns += now_ns() - st->held_since;
+
+        if (l->kind == QLOCK_MUTEX)
+        {
+                if (deadline)
+                        ret = pthread_cond_timedwait(&c->cond, &l->mutex, deadline);
+                else
+                        ret = pthread_cond_wait(&c->cond, &l->mutex);
+        }
+        else
+        {
+                /* A signal sent after we let go changes seq, so the
+                   futex wait returns straight away instead of missing it */
+                seq = __atomic_load_n(&c->seq, __ATOMIC_RELAXED);
+                qlock_release(l);
+                if (qlock_futex_wait(&c->seq, seq, deadline, FUTEX_BITSET_MATCH_ANY) == -1 &&
+                    errno == ETIMEDOUT)
+                        ret = ETIMEDOUT;
+                qlock_acquire(l);
+        }
+
+        st->held_since = now_ns();
+        return ret;
+}
+
+/* Called with l held */
+static inline void qcond_signal(qcond *c, qlock *l)
+{
+        if (l->kind == QLOCK_MUTEX)
+        {
+                pthread_cond_signal(&c->cond);
+                return;
+        }
+
+        __atomic_add_fetch(&c->seq, 1, __ATOMIC_RELAXED);
+        qlock_futex_wake(&c->seq, 1, FUTEX_BITSET_MATCH_ANY);
+}
+
+static inline void qcond_broadcast(qcond *c, qlock *l)
+{
+        if (l->kind == QLOCK_MUTEX)
+        {
+                pthread_cond_broadcast(&c->cond);
+                return;
+        }
+
+        __atomic_add_fetch(&c->seq, 1, __ATOMIC_RELAXED);
+        qlock_futex_wake(&c->seq, INT_MAX, FUTEX_BITSET_MATCH_ANY);
+}
+
+/* One line per process that used the lock, then the spread of
+   acquisitions between them */
+static inline void qlock_report(qlock *l, int nprocs)
+{
+        long min = -1, max = 0, total = 0;
+        qlock_stats *st;
+        int i;
+
+        if (nprocs > QLOCK_MAX_PROCS)
+                nprocs = QLOCK_MAX_PROCS;
+
+        fprintf(stderr, "Lock (%s): process, acquisitions, mean/max wait, mean hold\n",
+                qlock_name(l->kind));
+        for (i = 0; i < nprocs; i++)
+        {
+                st = &l->stats[i];
+                fprintf(stderr, "  %3d %9ld %9.2f / %9.1f us %9.2f us\n", i, st->acquisitions,
+                        st->acquisitions ? st->wait_ns / 1e3 / st->acquisitions : 0.0,
+                        st->max_wait_ns / 1e3,
+                        st->acquisitions ? st->hold_ns / 1e3 / st->acquisitions : 0.0);
+
+                total += st->acquisitions;
+                if (st->acquisitions > max)
+                        max = st->acquisitions;
+                if (min < 0 || st->acquisitions < min)
+                        min = st->acquisitions;
+        }
+
+        fprintf(stderr, "  %ld acquisitions, fewest %ld and most %ld per process\n",
+                total, min < 0 ? 0 : min, max);
+}
+
+#endif /* QLOCK_H */
@@ -0,0 +1,1316 @@
+/* queue.h  Bounded queue in shared memory for the producer-consumer programs
+ * Copyright (C) 2020  William Findlay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+/* You really shouldn't be incorporating parts of this in any other code,
+   it is meant for teaching, not production */
+
+/* This header is a template. Define the following and then include it,
+ * once per queue type you need:
+ *
+ *   QUEUE_NAME      prefix for the generated type and functions
+ *   QUEUE_TYPE      element type, copied in and out with memcpy
+ *   QUEUE_CAPACITY  number of slots, a compile time constant
+ *   QUEUE_POLICY    QUEUE_SPSC, QUEUE_MPSC or QUEUE_MPMC
+ *
+ * e.g.
+ *
+ *   #define QUEUE_NAME     wordq
+ *   #define QUEUE_TYPE     word_t
+ *   #define QUEUE_CAPACITY 32
+ *   #define QUEUE_POLICY   QUEUE_SPSC
+ *   #include "queue.h"
+ *
+ * generates the type wordq and wordq_init(), wordq_push(), wordq_pop() and
+ * so on. The queue must live in memory shared by every process using it
+ * (e.g. a MAP_SHARED mapping) and be initialized exactly once.
+ *
+ * The policy decides how the queue is locked:
+ *
+ *   QUEUE_SPSC  one producer and one consumer. Each slot has its own
+ *               lock bit and each side waits on its own mutex/condition
+ *               pair, so the producer and consumer never share a lock.
+ *   QUEUE_MPSC  many producers, one consumer. One mutex protects the
+ *               whole queue; producers are woken with a broadcast.
+ *   QUEUE_MPMC  many producers and consumers. One mutex protects the
+ *               whole queue; both sides are woken with a broadcast.
+ *
+ * Code for the other policies is removed by the preprocessor.
+ *
+ * push() blocks while the queue is full. offer() lets the producer pick
+ * what happens instead:
+ *
+ *   QUEUE_BLOCK      wait for room, like push()
+ *   QUEUE_TIMEOUT    wait for room for at most timeout_ms milliseconds
+ *   QUEUE_DROP       give up on the new item straight away
+ *   QUEUE_OVERWRITE  discard the oldest queued item to make room
+ *   QUEUE_SPILL      append the item to the queue's spill file instead
+ *                    (QUEUE_MPSC and QUEUE_MPMC, after set_spill()); if
+ *                    the write fails it waits for room, or is dropped
+ *                    while older items are still in the file
+ *
+ * Dropped, timed out and overwritten items are counted in q->overflow.
+ *
+ * Once anything has been spilled, every new item goes to the spill file
+ * too, until it has all been read back, so order is kept. Consumers empty
+ * the ring as usual; when they find it empty they refill it from the
+ * spill file, a ring's worth per read, and the file is truncated back to
+ * nothing as soon as the last spilled item is read. So the ring stays the
+ * same size, producers never wait while a consumer is stalled, and the
+ * file only takes up disk while there is a backlog. q->spill counts it.
+ *
+ * pop() takes one item per round trip. drain() takes every item that is
+ * ready (up to max) and wakes the producer side once for the whole batch,
+ * so a backed up queue costs one wakeup per batch instead of per item.
+ * With QUEUE_MPSC and QUEUE_MPMC drain() finds the run of full slots with
+ * a vectorised scan (see simd.h) and copies it out with one memcpy.
+ * QUEUE_SPSC has no scan: its one producer publishes last_produced after
+ * filling a slot, so drain() reads the run's end from that instead.
+ * try_pop() never waits; it returns QUEUE_EMPTY instead, for callers that
+ * watch many queues at once and do their own waiting.
+ *
+ * Defining QUEUE_COMBINING (to the number of processes that will use the
+ * queue) as well, with QUEUE_MPSC or QUEUE_MPMC, adds flat combining:
+ * fc_push() and fc_pop() post the operation in the caller's own
+ * publication slot, and whichever process gets cond_mutex carries out
+ * every posted operation in one pass. The others find theirs done without
+ * ever taking the lock, so the more processes contend, the more messages
+ * move per lock handoff. q->combining counts both. Ordinary push() and
+ * pop() callers can share the queue with combining ones.
+ *
+ * Defining QUEUE_QLOCK (to QLOCK_MUTEX or QLOCK_TICKET, see qlock.h) with
+ * QUEUE_MPSC or QUEUE_MPMC makes cond_mutex a qlock, which times every
+ * acquisition per process, and the conditions qconds. The value is the
+ * default kind of lock; set_lock() picks another before the queue is used.
+ *
+ * Each side counts how many processes are waiting on it and only signals
+ * its condition when somebody is, so a queue that never fills or empties
+ * makes no wakeup calls at all. q->wakeups counts the signals sent and the
+ * ones skipped.
+ *
+ * When built with TRACE defined, every enqueue, dequeue and wait is
+ * recorded with TRACE_EVENT() (see trace.h). */
+
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "qlock.h"
+#include "simd.h"
+#include "trace.h"
+
+#define QUEUE_SPSC 0
+#define QUEUE_MPSC 1
+#define QUEUE_MPMC 2
+
+/* What offer() does when the queue is full */
+#define QUEUE_BLOCK     0
+#define QUEUE_TIMEOUT   1
+#define QUEUE_DROP      2
+#define QUEUE_OVERWRITE 3
+#define QUEUE_SPILL     4
+
+/* offer() results other than 0 (queued) */
+#define QUEUE_DROPPED   1
+#define QUEUE_TIMEDOUT  2
+
+/* try_pop() result when nothing is ready yet */
+#define QUEUE_EMPTY     3
+
+/* Operations posted in a flat combining publication slot */
+#define QUEUE_FC_NONE 0
+#define QUEUE_FC_PUSH 1
+#define QUEUE_FC_POP  2
+
+/* How many times fc_push() and fc_pop() yield waiting for a combiner to
+   get to them before queueing on the lock themselves */
+#define QUEUE_FC_SPINS  16
+/* Passes a combiner makes over the publication slots while it keeps
+   finding work, so one process can't end up combining forever */
+#define QUEUE_FC_PASSES 4
+
+/* Bits of a slot's state byte */
+#define QUEUE_SLOT_FULL   1
+#define QUEUE_SLOT_LOCKED 2     /* QUEUE_SPSC only */
+
+typedef struct queue_overflow_stats {
+        int drops;
+        int timeouts;
+        int overwrites;
+} queue_overflow_stats;
+
+typedef struct queue_spill_stats {
+        int spilled;            /* items written to the spill file */
+        int refills;            /* reads that refilled the ring from it */
+        int reclaims;           /* times it was emptied and truncated */
+        long max_bytes;         /* largest it grew */
+} queue_spill_stats;
+
+/* Parse "block", "drop", "overwrite", "timeout:<ms>" or, if spill_path
+ * isn't NULL, "spill:<path>" */
+static inline int queue_parse_overflow(const char *arg, int *overflow, int *timeout_ms,
+                                       const char **spill_path)
+{
+        if (strcmp(arg, "block") == 0)
+                *overflow = QUEUE_BLOCK;
+        else if (strcmp(arg, "drop") == 0)
+                *overflow = QUEUE_DROP;
+        else if (strcmp(arg, "overwrite") == 0)
+                *overflow = QUEUE_OVERWRITE;
+        else if (strncmp(arg, "timeout:", 8) == 0 && atoi(arg + 8) > 0)
+        {
+                *overflow = QUEUE_TIMEOUT;
+                *timeout_ms = atoi(arg + 8);
+        }
+        else if (spill_path && strncmp(arg, "spill:", 6) == 0 && arg[6])
+        {
+                *overflow = QUEUE_SPILL;
+                *spill_path = arg + 6;
+        }
+        else
+                return -1;
+
+        return 0;
+}
+
+/* Each field is only written by one side (or under the queue lock) */
+typedef struct queue_wakeup_stats {
+        int nonempty_sent;      /* producer woke a consumer */
+        int nonempty_avoided;   /* ... or didn't need to */
+        int nonfull_sent;       /* consumer woke a producer */
+        int nonfull_avoided;
+} queue_wakeup_stats;
+
+static inline void queue_report_wakeups(queue_wakeup_stats *w)
+{
+        fprintf(stderr, "Wakeups: %d sent, %d avoided\n",
+                w->nonempty_sent + w->nonfull_sent,
+                w->nonempty_avoided + w->nonfull_avoided);
+}
+
+/* Written under the queue lock */
+typedef struct queue_combining_stats {
+        int holds;              /* times a combiner held the lock */
+        int ops;                /* operations carried out while holding it */
+} queue_combining_stats;
+
+static inline void queue_report_combining(queue_combining_stats *c)
+{
+        fprintf(stderr, "Combining: %d operations in %d lock holds (%.2f per hold)\n",
+                c->ops, c->holds, c->holds ? (double) c->ops / c->holds : 0.0);
+}
+
+static inline void queue_report_spill(queue_spill_stats *sp)
+{
+        fprintf(stderr, "Spill: %d items spilled, read back in %d refills, "
+                "file reclaimed %d times, at most %ld bytes\n",
+                sp->spilled, sp->refills, sp->reclaims, sp->max_bytes);
+}
+
+static inline void queue_report_overflow(queue_overflow_stats *o)
+{
+        fprintf(stderr, "Overflow: %d dropped, %d timed out, %d overwritten\n",
+                o->drops, o->timeouts, o->overwrites);
+}
+
+/* Absolute CLOCK_MONOTONIC deadline timeout_ms from now */
+static inline void queue_deadline(struct timespec *deadline, int timeout_ms)
+{
+        clock_gettime(CLOCK_MONOTONIC, deadline);
+        deadline->tv_sec  += timeout_ms / 1000;
+        deadline->tv_nsec += (timeout_ms % 1000) * 1000000L;
+        if (deadline->tv_nsec >= 1000000000L)
+        {
+                deadline->tv_sec++;
+                deadline->tv_nsec -= 1000000000L;
+        }
+}
+
+#define QUEUE_CAT_(a, b) a##_##b
+#define QUEUE_CAT(a, b) QUEUE_CAT_(a, b)
+
+#endif /* QUEUE_H */
+
+#if !defined(QUEUE_NAME) || !defined(QUEUE_TYPE) || \
+    !defined(QUEUE_CAPACITY) || !defined(QUEUE_POLICY)
+#error "QUEUE_NAME, QUEUE_TYPE, QUEUE_CAPACITY and QUEUE_POLICY must be defined before including queue.h"
+#endif
+
+#define QUEUE_FN(fn) QUEUE_CAT(QUEUE_NAME, fn)
+
+#ifdef QUEUE_QLOCK
+#if QUEUE_POLICY == QUEUE_SPSC
+#error "QUEUE_QLOCK needs QUEUE_MPSC or QUEUE_MPMC"
+#endif
+#define QUEUE_MUTEX qlock
+#define QUEUE_COND  qcond
+#else
+#define QUEUE_MUTEX pthread_mutex_t
+#define QUEUE_COND  pthread_cond_t
+#endif
+
+#ifdef QUEUE_COMBINING
+#if QUEUE_POLICY == QUEUE_SPSC
+#error "QUEUE_COMBINING needs QUEUE_MPSC or QUEUE_MPMC"
+#endif
+
+/* One per process, each on its own cache line. The owner fills in item
+ * (for a push) and then op; the combiner fills in result and item (for a
+ * pop) and then sets op back to QUEUE_FC_NONE. */
+typedef struct QUEUE_FN(fc_slot) {
+        int op;
+        int result;
+        QUEUE_TYPE item;
+} __attribute__((aligned(64))) QUEUE_FN(fc_slot);
+#endif
+
+/* Items and slot states are kept in separate arrays so that small items
+ * pack densely, e.g. 64 one-byte items per cache line. A slot's whole
+ * state, full flag and (for QUEUE_SPSC) lock, is one byte. */
+typedef struct QUEUE_NAME {
+#if QUEUE_POLICY == QUEUE_SPSC
+        pthread_mutex_t nonfull_mutex;
+        pthread_mutex_t nonempty_mutex;
+#else
+        QUEUE_MUTEX cond_mutex;
+#endif
+        QUEUE_COND  queue_nonempty;
+        QUEUE_COND  queue_nonfull;
+        QUEUE_TYPE items[QUEUE_CAPACITY];
+        unsigned char state[QUEUE_CAPACITY];
+        int last_produced;
+        int last_consumed;
+        int prod_count;
+        int con_count;
+        int closed;
+        int nonempty_waiters;   /* consumers waiting for an item */
+        int nonfull_waiters;    /* producers waiting for room */
+        queue_overflow_stats overflow;
+        queue_wakeup_stats wakeups;
+#if QUEUE_POLICY != QUEUE_SPSC
+        int spill_fd;           /* -1 unless set_spill() was called */
+        long spill_head;        /* offset of the oldest spilled item */
+        long spill_tail;        /* ... and of the end of the file */
+        queue_spill_stats spill;
+#endif
+#ifdef QUEUE_COMBINING
+        queue_combining_stats combining;
+        QUEUE_FN(fc_slot) fc[QUEUE_COMBINING];
+#endif
+} QUEUE_NAME;
+
+/* (Re)initialize only the locks and conditions, leaving the contents alone */
+static inline void QUEUE_FN(init_sync)(QUEUE_NAME *q)
+{
+        pthread_mutexattr_t mattr;
+#ifndef QUEUE_QLOCK
+        pthread_condattr_t cattr;
+#endif
+#if QUEUE_POLICY == QUEUE_SPSC
+        int i;
+#endif
+
+        /* We need to explicitly mark the mutex as shared or
+           risk undefined behavior */
+        pthread_mutexattr_init(&mattr);
+        pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+#if QUEUE_POLICY == QUEUE_SPSC
+        pthread_mutex_init(&q->nonfull_mutex, &mattr);
+        pthread_mutex_init(&q->nonempty_mutex, &mattr);
+#elif defined(QUEUE_QLOCK)
+        qlock_init(&q->cond_mutex, q->cond_mutex.kind);
+#else
+        pthread_mutex_init(&q->cond_mutex, &mattr);
+#endif
+        pthread_mutexattr_destroy(&mattr);
+
+#ifdef QUEUE_QLOCK
+        qcond_init(&q->queue_nonempty);
+        qcond_init(&q->queue_nonfull);
+#else
+        /* We need to explicitly mark the conditions as shared or
+           risk undefined behavior */
+        pthread_condattr_init(&cattr);
+        pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+        /* timed waits use CLOCK_MONOTONIC deadlines */
+        pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+        pthread_cond_init(&q->queue_nonempty, &cattr);
+        pthread_cond_init(&q->queue_nonfull, &cattr);
+        pthread_condattr_destroy(&cattr);
+#endif
+
+#if QUEUE_POLICY == QUEUE_SPSC
+        for (i=0; i<QUEUE_CAPACITY; i++)
+        {
+                /* a slot may have been left locked by a process that died */
+                q->state[i] &= ~QUEUE_SLOT_LOCKED;
+        }
+#endif
+}
+
+static inline void QUEUE_FN(init)(QUEUE_NAME *q)
+{
+        int i;
+
+#ifdef QUEUE_QLOCK
+        q->cond_mutex.kind = QUEUE_QLOCK;
+#endif
+        QUEUE_FN(init_sync)(q);
+
+        q->last_consumed = -1;
+        q->last_produced = -1;
+
+        q->prod_count = 0;
+        q->con_count  = 0;
+
+        q->closed = 0;
+
+        q->nonempty_waiters = 0;
+        q->nonfull_waiters = 0;
+
+        memset(&q->overflow, 0, sizeof(q->overflow));
+        memset(&q->wakeups, 0, sizeof(q->wakeups));
+#if QUEUE_POLICY != QUEUE_SPSC
+        q->spill_fd = -1;
+        q->spill_head = q->spill_tail = 0;
+        memset(&q->spill, 0, sizeof(q->spill));
+#endif
+#ifdef QUEUE_COMBINING
+        memset(&q->combining, 0, sizeof(q->combining));
+        memset(q->fc, 0, sizeof(q->fc));
+#endif
+
+        for (i=0; i<QUEUE_CAPACITY; i++)
+        {
+                q->state[i] = 0;
+        }
+}
+
+/* Bytes each slot costs: the item plus its state */
+static inline size_t QUEUE_FN(slot_bytes)(void)
+{
+        return sizeof(QUEUE_TYPE) + sizeof(unsigned char);
+}
+
+#if QUEUE_POLICY == QUEUE_SPSC
+
+/* The producer and consumer use different locks, so the full flag is read
+ * and written atomically; the condition mutex is held while checking it
+ * so that a wakeup can't slip in between the check and the wait. */
+static inline int QUEUE_FN(slot_full)(QUEUE_NAME *q, int current)
+{
+        return __atomic_load_n(&q->state[current], __ATOMIC_ACQUIRE) & QUEUE_SLOT_FULL;
+}
+
+/* A slot is only ever locked long enough to copy one item in or out, so
+ * rather than sleep we spin, yielding the CPU in case whoever holds the
+ * lock has been preempted. */
+static inline void QUEUE_FN(lock_slot)(QUEUE_NAME *q, int current)
+{
+        unsigned char state;
+
+        for (;;)
+        {
+                state = __atomic_load_n(&q->state[current], __ATOMIC_RELAXED);
+                if (!(state & QUEUE_SLOT_LOCKED) &&
+                    __atomic_compare_exchange_n(&q->state[current], &state,
+                                                state | QUEUE_SLOT_LOCKED, 0,
+                                                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                        return;
+                sched_yield();
+        }
+}
+
+static inline void QUEUE_FN(unlock_slot)(QUEUE_NAME *q, int current)
+{
+        __atomic_fetch_and(&q->state[current], ~QUEUE_SLOT_LOCKED, __ATOMIC_RELEASE);
+}
+
+/* Only the lock holder changes the full bit, so a plain store will do;
+   unlocking publishes it */
+static inline void QUEUE_FN(set_full)(QUEUE_NAME *q, int current, int full)
+{
+        __atomic_store_n(&q->state[current],
+                         QUEUE_SLOT_LOCKED | (full ? QUEUE_SLOT_FULL : 0),
+                         __ATOMIC_RELAXED);
+}
+
+/* A waiter announces itself before checking the slot, and a notifier
+ * checks for waiters after changing the slot. The fences between the two
+ * steps on each side make sure at least one of them sees the other, so a
+ * skipped signal can never leave somebody asleep. */
+static inline void QUEUE_FN(wait_for_producer)(QUEUE_NAME *q, int current)
+{
+        fprintf(stderr, "Waiting for producer...\n");
+        TRACE_EVENT(TRACE_WAIT_PRODUCER, current);
+        pthread_mutex_lock(&q->nonempty_mutex);
+        __atomic_add_fetch(&q->nonempty_waiters, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        while (!QUEUE_FN(slot_full)(q, current) && !q->closed)
+                pthread_cond_wait(&q->queue_nonempty, &q->nonempty_mutex);
+        __atomic_sub_fetch(&q->nonempty_waiters, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&q->nonempty_mutex);
+        TRACE_EVENT(TRACE_WOKE, current);
+}
+
+/* Returns ETIMEDOUT if deadline (when not NULL) passes first */
+static inline int QUEUE_FN(wait_for_consumer)(QUEUE_NAME *q, int current,
+                                              struct timespec *deadline)
+{
+        int ret = 0;
+
+        fprintf(stderr, "Waiting for consumer...\n");
+        TRACE_EVENT(TRACE_WAIT_CONSUMER, current);
+        pthread_mutex_lock(&q->nonfull_mutex);
+        __atomic_add_fetch(&q->nonfull_waiters, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        while (QUEUE_FN(slot_full)(q, current) && ret != ETIMEDOUT)
+        {
+                if (deadline)
+                        ret = pthread_cond_timedwait(&q->queue_nonfull, &q->nonfull_mutex, deadline);
+                else
+                        pthread_cond_wait(&q->queue_nonfull, &q->nonfull_mutex);
+        }
+        __atomic_sub_fetch(&q->nonfull_waiters, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&q->nonfull_mutex);
+        TRACE_EVENT(TRACE_WOKE, current);
+
+        return QUEUE_FN(slot_full)(q, current) ? ret : 0;
+}
+
+/* Called by the producer after filling a slot */
+static inline void QUEUE_FN(notify_consumer)(QUEUE_NAME *q)
+{
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&q->nonempty_waiters, __ATOMIC_RELAXED))
+        {
+                q->wakeups.nonempty_avoided++;
+                return;
+        }
+
+        pthread_mutex_lock(&q->nonempty_mutex);
+        pthread_cond_signal(&q->queue_nonempty);
+        pthread_mutex_unlock(&q->nonempty_mutex);
+        q->wakeups.nonempty_sent++;
+}
+
+/* Called by the consumer after emptying one or more slots */
+static inline void QUEUE_FN(notify_producer)(QUEUE_NAME *q)
+{
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&q->nonfull_waiters, __ATOMIC_RELAXED))
+        {
+                q->wakeups.nonfull_avoided++;
+                return;
+        }
+
+        pthread_mutex_lock(&q->nonfull_mutex);
+        pthread_cond_signal(&q->queue_nonfull);
+        pthread_mutex_unlock(&q->nonfull_mutex);
+        q->wakeups.nonfull_sent++;
+}
+
+/* last_consumed is normally the consumer's alone, but an overwriting
+ * producer also advances it. Both only ever change it while holding the
+ * lock of the slot after it, so the consumer re-reads it once it has
+ * that lock to find out whether its slot was taken over. */
+static inline int QUEUE_FN(next_to_consume)(QUEUE_NAME *q)
+{
+        return (__atomic_load_n(&q->last_consumed, __ATOMIC_ACQUIRE) + 1) % QUEUE_CAPACITY;
+}
+
+static inline int QUEUE_FN(offer)(QUEUE_NAME *q, const QUEUE_TYPE *item,
+                                  int overflow, int timeout_ms)
+{
+        struct timespec deadline;
+        int current;
+
+        if (overflow == QUEUE_TIMEOUT)
+                queue_deadline(&deadline, timeout_ms);
+
+        current = (q->last_produced + 1) % QUEUE_CAPACITY;
+        QUEUE_FN(lock_slot)(q, current);
+
+        while (QUEUE_FN(slot_full)(q, current))
+        {
+                /* consumer hasn't consumed this entry yet */
+                if (overflow == QUEUE_DROP)
+                {
+                        q->overflow.drops++;
+                        QUEUE_FN(unlock_slot)(q, current);
+                        return QUEUE_DROPPED;
+                }
+                if (overflow == QUEUE_OVERWRITE)
+                {
+                        /* The queue is full, so this is also the oldest
+                           entry; drop it by moving the consumer past it */
+                        q->overflow.overwrites++;
+                        __atomic_store_n(&q->last_consumed, current, __ATOMIC_RELEASE);
+                        break;
+                }
+                QUEUE_FN(unlock_slot)(q, current);
+                if (QUEUE_FN(wait_for_consumer)(q, current,
+                            overflow == QUEUE_TIMEOUT ? &deadline : NULL) == ETIMEDOUT)
+                {
+                        q->overflow.timeouts++;
+                        return QUEUE_TIMEDOUT;
+                }
+                QUEUE_FN(lock_slot)(q, current);
+        }
+
+        memcpy(&q->items[current], item, sizeof(QUEUE_TYPE));
+        TRACE_EVENT(TRACE_ENQUEUE, current);
+        QUEUE_FN(set_full)(q, current, 1);
+        /* drain() reads this to find how far the filled slots go */
+        __atomic_store_n(&q->last_produced, current, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&q->prod_count, 1, __ATOMIC_RELAXED);
+
+        QUEUE_FN(unlock_slot)(q, current);
+
+        /* Notify that queue is nonempty */
+        QUEUE_FN(notify_consumer)(q);
+
+        return 0;
+}
+
+/* Returns -1 once the queue is closed and empty */
+static inline int QUEUE_FN(pop)(QUEUE_NAME *q, QUEUE_TYPE *item)
+{
+        int current;
+
+        for (;;)
+        {
+                current = QUEUE_FN(next_to_consume)(q);
+                QUEUE_FN(lock_slot)(q, current);
+
+                if (current != QUEUE_FN(next_to_consume)(q))
+                {
+                        /* an overwriting producer got here first */
+                        QUEUE_FN(unlock_slot)(q, current);
+                        continue;
+                }
+                if (QUEUE_FN(slot_full)(q, current))
+                        break;
+
+                /* producer hasn't filled in this entry yet */
+                QUEUE_FN(unlock_slot)(q, current);
+                /* re-check the slot after seeing closed, since the last
+                   word may have been queued just before the close */
+                if (__atomic_load_n(&q->closed, __ATOMIC_ACQUIRE) &&
+                    !QUEUE_FN(slot_full)(q, current))
+                        return -1;
+                QUEUE_FN(wait_for_producer)(q, current);
+        }
+
+        memcpy(item, &q->items[current], sizeof(QUEUE_TYPE));
+        TRACE_EVENT(TRACE_DEQUEUE, current);
+        QUEUE_FN(set_full)(q, current, 0);
+        __atomic_store_n(&q->last_consumed, current, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&q->con_count, 1, __ATOMIC_RELAXED);
+
+        QUEUE_FN(unlock_slot)(q, current);
+
+        /* Notify that queue is nonfull */
+        QUEUE_FN(notify_producer)(q);
+
+        return 0;
+}
+
+/* Returns QUEUE_EMPTY instead of waiting, or -1 once the queue is closed and empty */
+static inline int QUEUE_FN(try_pop)(QUEUE_NAME *q, QUEUE_TYPE *item)
+{
+        int current;
+
+        for (;;)
+        {
+                current = QUEUE_FN(next_to_consume)(q);
+                QUEUE_FN(lock_slot)(q, current);
+
+                if (current != QUEUE_FN(next_to_consume)(q))
+                {
+                        /* an overwriting producer got here first */
+                        QUEUE_FN(unlock_slot)(q, current);
+                        continue;
+                }
+                if (QUEUE_FN(slot_full)(q, current))
+                        break;
+
+                QUEUE_FN(unlock_slot)(q, current);
+                if (__atomic_load_n(&q->closed, __ATOMIC_ACQUIRE) &&
+                    !QUEUE_FN(slot_full)(q, current))
+                        return -1;
+                return QUEUE_EMPTY;
+        }
+
+        memcpy(item, &q->items[current], sizeof(QUEUE_TYPE));
+        TRACE_EVENT(TRACE_DEQUEUE, current);
+        QUEUE_FN(set_full)(q, current, 0);
+        __atomic_store_n(&q->last_consumed, current, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&q->con_count, 1, __ATOMIC_RELAXED);
+
+        QUEUE_FN(unlock_slot)(q, current);
+
+        QUEUE_FN(notify_producer)(q);
+
+        return 0;
+}
+
+/* Returns the number of items taken, or -1 once the queue is closed and empty.
+ *
+ * Only the first slot is locked. The producer fills slots in order, so
+ * with that one held it can't get to (or overwrite) any of the slots
+ * after it that are being taken, and everything up to last_produced, read
+ * once, is ready. The run is copied out, the full bits are cleared, and
+ * last_consumed is published and the producer woken once for the lot. */
+static inline int QUEUE_FN(drain)(QUEUE_NAME *q, QUEUE_TYPE *items, int max)
+{
+        int first, last, n, k, i;
+
+        if (max < 1)
+                return 0;
+
+        for (;;)
+        {
+                first = QUEUE_FN(next_to_consume)(q);
+                QUEUE_FN(lock_slot)(q, first);
+
+                if (first != QUEUE_FN(next_to_consume)(q))
+                {
+                        /* an overwriting producer got here first */
+                        QUEUE_FN(unlock_slot)(q, first);
+                        continue;
+                }
+                if (QUEUE_FN(slot_full)(q, first))
+                        break;
+
+                QUEUE_FN(unlock_slot)(q, first);
+                if (__atomic_load_n(&q->closed, __ATOMIC_ACQUIRE) &&
+                    !QUEUE_FN(slot_full)(q, first))
+                        return -1;
+                QUEUE_FN(wait_for_producer)(q, first);
+        }
+
+        /* first is full, so last_produced can't be just behind it unless
+           the whole ring is full */
+        last = __atomic_load_n(&q->last_produced, __ATOMIC_ACQUIRE);
+        n = (last - first + QUEUE_CAPACITY) % QUEUE_CAPACITY + 1;
+        if (n > max)
+                n = max;
+
+        /* the run may wrap around the end of the ring */
+        k = first + n <= QUEUE_CAPACITY ? n : QUEUE_CAPACITY - first;
+        memcpy(items, &q->items[first], k * sizeof(QUEUE_TYPE));
+        memcpy(items + k, &q->items[0], (n - k) * sizeof(QUEUE_TYPE));
+
+        TRACE_EVENT(TRACE_DEQUEUE, first);
+        QUEUE_FN(set_full)(q, first, 0);
+        for (i = 1; i < n; i++)
+        {
+                TRACE_EVENT(TRACE_DEQUEUE, (first + i) % QUEUE_CAPACITY);
+                __atomic_store_n(&q->state[(first + i) % QUEUE_CAPACITY], 0, __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&q->last_consumed, (first + n - 1) % QUEUE_CAPACITY, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&q->con_count, n, __ATOMIC_RELAXED);
+
+        /* unlocking first publishes the cleared slots to the producer */
+        QUEUE_FN(unlock_slot)(q, first);
+
+        /* Notify once that queue is nonfull */
+        QUEUE_FN(notify_producer)(q);
+
+        return n;
+}
+
+/* No more words will be pushed; wake the consumer so it can drain and stop */
+static inline void QUEUE_FN(close)(QUEUE_NAME *q)
+{
+        pthread_mutex_lock(&q->nonempty_mutex);
+        __atomic_store_n(&q->closed, 1, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&q->queue_nonempty);
+        pthread_mutex_unlock(&q->nonempty_mutex);
+}
+
+#else /* QUEUE_MPSC || QUEUE_MPMC */
+
+/* cond_mutex and the conditions are pthread ones, or a qlock and qconds
+   with QUEUE_QLOCK */
+static inline void QUEUE_FN(lock)(QUEUE_NAME *q)
+{
+#ifdef QUEUE_QLOCK
+        qlock_lock(&q->cond_mutex);
+#else
+        pthread_mutex_lock(&q->cond_mutex);
+#endif
+}
+
+static inline int QUEUE_FN(trylock)(QUEUE_NAME *q)
+{
+#ifdef QUEUE_QLOCK
+        return qlock_trylock(&q->cond_mutex);
+#else
+        return pthread_mutex_trylock(&q->cond_mutex);
+#endif
+}
+
+static inline void QUEUE_FN(unlock)(QUEUE_NAME *q)
+{
+#ifdef QUEUE_QLOCK
+        qlock_unlock(&q->cond_mutex);
+#else
+        pthread_mutex_unlock(&q->cond_mutex);
+#endif
+}
+
+/* Returns ETIMEDOUT if deadline (when not NULL) passes first */
+static inline int QUEUE_FN(cond_wait)(QUEUE_NAME *q, QUEUE_COND *cond, struct timespec *deadline)
+{
+#ifdef QUEUE_QLOCK
+        return qcond_wait(cond, &q->cond_mutex, deadline);
+#else
+        if (deadline)
+                return pthread_cond_timedwait(cond, &q->cond_mutex, deadline);
+        return pthread_cond_wait(cond, &q->cond_mutex);
+#endif
+}
+
+static inline void QUEUE_FN(cond_signal)(QUEUE_NAME *q, QUEUE_COND *cond)
+{
+#ifdef QUEUE_QLOCK
+        qcond_signal(cond, &q->cond_mutex);
+#else
+        pthread_cond_signal(cond);
+#endif
+}
+
+static inline void QUEUE_FN(cond_broadcast)(QUEUE_NAME *q, QUEUE_COND *cond)
+{
+#ifdef QUEUE_QLOCK
+        qcond_broadcast(cond, &q->cond_mutex);
+#else
+        pthread_cond_broadcast(cond);
+#endif
+}
+
+#ifdef QUEUE_QLOCK
+/* Switch to another kind of lock; only before anyone uses the queue */
+static inline void QUEUE_FN(set_lock)(QUEUE_NAME *q, int kind)
+{
+        qlock_init(&q->cond_mutex, kind);
+}
+#endif
+
+/* The waits and notifies are all called with cond_mutex held */
+static inline void QUEUE_FN(wait_for_producer)(QUEUE_NAME *q)
+{
+        fprintf(stderr, "Waiting for producer...\n");
+        TRACE_EVENT(TRACE_WAIT_PRODUCER, (q->last_consumed + 1) % QUEUE_CAPACITY);
+        q->nonempty_waiters++;
+        QUEUE_FN(cond_wait)(q, &q->queue_nonempty, NULL);
+        q->nonempty_waiters--;
+        TRACE_EVENT(TRACE_WOKE, (q->last_consumed + 1) % QUEUE_CAPACITY);
+}
+
+/* Returns ETIMEDOUT if deadline (when not NULL) passes first */
+static inline int QUEUE_FN(wait_for_consumer)(QUEUE_NAME *q, struct timespec *deadline)
+{
+        int ret;
+
+        fprintf(stderr, "Waiting for consumer...\n");
+        TRACE_EVENT(TRACE_WAIT_CONSUMER, (q->last_produced + 1) % QUEUE_CAPACITY);
+        q->nonfull_waiters++;
+        ret = QUEUE_FN(cond_wait)(q, &q->queue_nonfull, deadline);
+        q->nonfull_waiters--;
+        TRACE_EVENT(TRACE_WOKE, (q->last_produced + 1) % QUEUE_CAPACITY);
+
+        return ret;
+}
+
+static inline void QUEUE_FN(notify_consumer)(QUEUE_NAME *q)
+{
+        if (!q->nonempty_waiters)
+        {
+                q->wakeups.nonempty_avoided++;
+                return;
+        }
+
+#if QUEUE_POLICY == QUEUE_MPMC
+        QUEUE_FN(cond_broadcast)(q, &q->queue_nonempty);
+#else
+        QUEUE_FN(cond_signal)(q, &q->queue_nonempty);
+#endif
+        q->wakeups.nonempty_sent++;
+}
+
+static inline void QUEUE_FN(notify_producer)(QUEUE_NAME *q)
+{
+        if (!q->nonfull_waiters)
+        {
+                q->wakeups.nonfull_avoided++;
+                return;
+        }
+
+        QUEUE_FN(cond_broadcast)(q, &q->queue_nonfull);
+        q->wakeups.nonfull_sent++;
+}
+
+/* fd must be open for reading and writing, and stay open in every
+   process using the queue; call before anyone offers QUEUE_SPILL */
+static inline void QUEUE_FN(set_spill)(QUEUE_NAME *q, int fd)
+{
+        q->spill_fd = fd;
+        q->spill_head = q->spill_tail = 0;
+}
+
+/* The rest of the spill functions are called with cond_mutex held */
+static inline int QUEUE_FN(spilled)(QUEUE_NAME *q)
+{
+        return q->spill_tail > q->spill_head;
+}
+
+/* Returns 0 if item was appended to the spill file */
+static inline int QUEUE_FN(spill_item)(QUEUE_NAME *q, const QUEUE_TYPE *item)
+{
+        if (q->spill_fd < 0 ||
+            pwrite(q->spill_fd, item, sizeof(QUEUE_TYPE), q->spill_tail) != sizeof(QUEUE_TYPE))
+        {
+                fprintf(stderr, "Error: Unable to spill: %s\n",
+                        q->spill_fd < 0 ? "no spill file" : strerror(errno));
+                return -1;
+        }
+
+        q->spill_tail += sizeof(QUEUE_TYPE);
+        q->spill.spilled++;
+        if (q->spill_tail > q->spill.max_bytes)
+                q->spill.max_bytes = q->spill_tail;
+        return 0;
+}
+
+/* Only called when the ring is empty: read back as many spilled items as
+ * fit, oldest first, and queue them as if they had just been pushed.
+ * Returns the number read. */
+static inline int QUEUE_FN(refill)(QUEUE_NAME *q)
+{
+        int start, n, first;
+        size_t bytes;
+
+        if (!QUEUE_FN(spilled)(q))
+                return 0;
+
+        start = (q->last_produced + 1) % QUEUE_CAPACITY;
+        n = (q->spill_tail - q->spill_head) / sizeof(QUEUE_TYPE);
+        if (n > QUEUE_CAPACITY)
+                n = QUEUE_CAPACITY;
+        /* up to the end of the ring, then the rest from the start */
+        first = n < QUEUE_CAPACITY - start ? n : QUEUE_CAPACITY - start;
+
+        bytes = first * sizeof(QUEUE_TYPE);
+        if (pread(q->spill_fd, &q->items[start], bytes, q->spill_head) != (ssize_t) bytes ||
+            (n > first &&
+             pread(q->spill_fd, &q->items[0], (n - first) * sizeof(QUEUE_TYPE),
+                   q->spill_head + bytes) != (ssize_t) ((n - first) * sizeof(QUEUE_TYPE))))
+        {
+                /* nothing sensible to do with the rest; count it as dropped */
+                fprintf(stderr, "Error: Unable to read back spilled items: %s\n", strerror(errno));
+                q->overflow.drops += (q->spill_tail - q->spill_head) / sizeof(QUEUE_TYPE);
+                q->spill_head = q->spill_tail;
+                n = first = 0;
+        }
+
+        memset(&q->state[start], QUEUE_SLOT_FULL, first);
+        memset(&q->state[0], QUEUE_SLOT_FULL, n - first > 0 ? n - first : 0);
+        if (n > 0)
+                q->last_produced = (start + n - 1) % QUEUE_CAPACITY;
+        q->spill_head += n * sizeof(QUEUE_TYPE);
+        q->spill.refills++;
+
+        /* All read back, so give the disk space back and let producers
+           use the ring again */
+        if (!QUEUE_FN(spilled)(q))
+        {
+                if (ftruncate(q->spill_fd, 0) == -1)
+                        fprintf(stderr, "Error: Unable to truncate spill file: %s\n", strerror(errno));
+                q->spill_head = q->spill_tail = 0;
+                q->spill.reclaims++;
+        }
+
+        return n;
+}
+
+static inline int QUEUE_FN(offer)(QUEUE_NAME *q, const QUEUE_TYPE *item,
+                                  int overflow, int timeout_ms)
+{
+        struct timespec deadline;
+        int current;
+
+        if (overflow == QUEUE_TIMEOUT)
+                queue_deadline(&deadline, timeout_ms);
+
+        QUEUE_FN(lock)(q);
+
+        current = (q->last_produced + 1) % QUEUE_CAPACITY;
+
+        /* Spill if the ring is full, or if older items are already in the
+           spill file and this one must come after them */
+        if (overflow == QUEUE_SPILL && (q->state[current] || QUEUE_FN(spilled)(q)))
+        {
+                if (QUEUE_FN(spill_item)(q, item) == 0)
+                {
+                        q->prod_count++;
+                        QUEUE_FN(notify_consumer)(q);
+                        QUEUE_FN(unlock)(q);
+                        return 0;
+                }
+                /* The ring would hand it out ahead of the spilled
+                   backlog, so with one it has to be dropped; without
+                   one, wait for room in the ring instead */
+                if (QUEUE_FN(spilled)(q))
+                {
+                        q->overflow.drops++;
+                        QUEUE_FN(unlock)(q);
+                        return QUEUE_DROPPED;
+                }
+        }
+
+        while (q->state[current])
+        {
+                /* consumer hasn't consumed this entry yet */
+                if (overflow == QUEUE_DROP)
+                {
+                        q->overflow.drops++;
+                        QUEUE_FN(unlock)(q);
+                        return QUEUE_DROPPED;
+                }
+                if (overflow == QUEUE_OVERWRITE)
+                {
+                        /* The queue is full, so this is also the oldest
+                           entry; drop it by moving the consumers past it */
+                        q->overflow.overwrites++;
+                        q->last_consumed = current;
+                        break;
+                }
+                if (QUEUE_FN(wait_for_consumer)(q,
+                            overflow == QUEUE_TIMEOUT ? &deadline : NULL) == ETIMEDOUT &&
+                    q->state[(q->last_produced + 1) % QUEUE_CAPACITY])
+                {
+                        q->overflow.timeouts++;
+                        QUEUE_FN(unlock)(q);
+                        return QUEUE_TIMEDOUT;
+                }
+                current = (q->last_produced + 1) % QUEUE_CAPACITY;
+        }
+
+        memcpy(&q->items[current], item, sizeof(QUEUE_TYPE));
+        TRACE_EVENT(TRACE_ENQUEUE, current);
+        q->state[current] = QUEUE_SLOT_FULL;
+        q->last_produced = current;
+        q->prod_count++;
+
+        /* Notify that queue is nonempty */
+        QUEUE_FN(notify_consumer)(q);
+
+        QUEUE_FN(unlock)(q);
+        return 0;
+}
+
+/* Returns -1 once the queue is closed and empty */
+static inline int QUEUE_FN(pop)(QUEUE_NAME *q, QUEUE_TYPE *item)
+{
+        int current;
+
+        QUEUE_FN(lock)(q);
+
+        current = (q->last_consumed + 1) % QUEUE_CAPACITY;
+
+        while (!q->state[current])
+        {
+                /* an empty ring may still have spilled items behind it */
+                if (QUEUE_FN(refill)(q))
+                        continue;
+                if (q->closed)
+                {
+                        /* nothing left and nothing more coming */
+                        QUEUE_FN(unlock)(q);
+                        return -1;
+                }
+                /* producer hasn't filled in this entry yet */
+                QUEUE_FN(wait_for_producer)(q);
+                current = (q->last_consumed + 1) % QUEUE_CAPACITY;
+        }
+
+        memcpy(item, &q->items[current], sizeof(QUEUE_TYPE));
+        TRACE_EVENT(TRACE_DEQUEUE, current);
+        q->state[current] = 0;
+        q->last_consumed = current;
+        q->con_count++;
+
+        /* Notify that queue is nonfull */
+        QUEUE_FN(notify_producer)(q);
+
+        QUEUE_FN(unlock)(q);
+        return 0;
+}
+
+/* Returns QUEUE_EMPTY instead of waiting, or -1 once the queue is closed and empty */
+static inline int QUEUE_FN(try_pop)(QUEUE_NAME *q, QUEUE_TYPE *item)
+{
+        int current, ret = 0;
+
+        QUEUE_FN(lock)(q);
+
+        current = (q->last_consumed + 1) % QUEUE_CAPACITY;
+
+        if (!q->state[current] && !QUEUE_FN(refill)(q))
+        {
+                ret = q->closed ? -1 : QUEUE_EMPTY;
+                QUEUE_FN(unlock)(q);
+                return ret;
+        }
+
+        memcpy(item, &q->items[current], sizeof(QUEUE_TYPE));
+        TRACE_EVENT(TRACE_DEQUEUE, current);
+        q->state[current] = 0;
+        q->last_consumed = current;
+        q->con_count++;
+
+        QUEUE_FN(notify_producer)(q);
+
+        QUEUE_FN(unlock)(q);
+        return ret;
+}
+
+/* Returns the number of items taken, or -1 once the queue is closed and empty */
+static inline int QUEUE_FN(drain)(QUEUE_NAME *q, QUEUE_TYPE *items, int max)
+{
+        int current, n = 0, i, run, limit;
+
+        QUEUE_FN(lock)(q);
+
+        current = (q->last_consumed + 1) % QUEUE_CAPACITY;
+
+        while (!q->state[current])
+        {
+                /* an empty ring may still have spilled items behind it */
+                if (QUEUE_FN(refill)(q))
+                        continue;
+                if (q->closed)
+                {
+                        /* nothing left and nothing more coming */
+                        QUEUE_FN(unlock)(q);
+                        return -1;
+                }
+                /* producer hasn't filled in this entry yet */
+                QUEUE_FN(wait_for_producer)(q);
+                current = (q->last_consumed + 1) % QUEUE_CAPACITY;
+        }
+
+        /* Producers are locked out, so the run of full slots stays put
+           while we find its length and copy it out in one go (two if it
+           wraps around the end of the ring) */
+        while (n < max)
+        {
+                limit = QUEUE_CAPACITY - current;
+                if (limit > max - n)
+                        limit = max - n;
+
+                run = simd_ready_run(&q->state[current], limit, QUEUE_SLOT_FULL);
+                memcpy(&items[n], &q->items[current], run * sizeof(QUEUE_TYPE));
+                memset(&q->state[current], 0, run);
+                for (i = 0; i < run; i++)
+                        TRACE_EVENT(TRACE_DEQUEUE, current + i);
+
+                n += run;
+                current = (current + run) % QUEUE_CAPACITY;
+                if (run < limit)
+                        break;
+        }
+
+        q->last_consumed = (current + QUEUE_CAPACITY - 1) % QUEUE_CAPACITY;
+        q->con_count += n;
+
+        /* Notify once that queue is nonfull */
+        QUEUE_FN(notify_producer)(q);
+
+        QUEUE_FN(unlock)(q);
+        return n;
+}
+
+/* No more words will be pushed; wake every consumer so they can drain and stop */
+static inline void QUEUE_FN(close)(QUEUE_NAME *q)
+{
+        QUEUE_FN(lock)(q);
+        q->closed = 1;
+        QUEUE_FN(cond_broadcast)(q, &q->queue_nonempty);
+        QUEUE_FN(unlock)(q);
+}
+
+#ifdef QUEUE_COMBINING
+
+/* Called with cond_mutex held. Carries out every posted operation that
+ * can be; a push waits while the queue is full and a pop while it is
+ * empty (and open), just as push() and pop() would. Returns how many were
+ * carried out. */
+static inline int QUEUE_FN(combine)(QUEUE_NAME *q)
+{
+        int i, op, current, pass, done, pushed = 0, popped = 0;
+        QUEUE_FN(fc_slot) *slot;
+
+        for (pass = 0; pass < QUEUE_FC_PASSES; pass++)
+        {
+                done = 0;
+                for (i = 0; i < QUEUE_COMBINING; i++)
+                {
+                        slot = &q->fc[i];
+                        op = __atomic_load_n(&slot->op, __ATOMIC_ACQUIRE);
+
+                        if (op == QUEUE_FC_PUSH)
+                        {
+                                current = (q->last_produced + 1) % QUEUE_CAPACITY;
+                                if (q->state[current])
+                                        continue;
+                                memcpy(&q->items[current], &slot->item, sizeof(QUEUE_TYPE));
+                                TRACE_EVENT(TRACE_ENQUEUE, current);
+                                q->state[current] = QUEUE_SLOT_FULL;
+                                q->last_produced = current;
+                                q->prod_count++;
+                                slot->result = 0;
+                                pushed++;
+                        }
+                        else if (op == QUEUE_FC_POP)
+                        {
+                                current = (q->last_consumed + 1) % QUEUE_CAPACITY;
+                                if (q->state[current] || QUEUE_FN(refill)(q))
+                                {
+                                        memcpy(&slot->item, &q->items[current], sizeof(QUEUE_TYPE));
+                                        TRACE_EVENT(TRACE_DEQUEUE, current);
+                                        q->state[current] = 0;
+                                        q->last_consumed = current;
+                                        q->con_count++;
+                                        slot->result = 0;
+                                }
+                                else if (q->closed)
+                                        slot->result = -1;
+                                else
+                                        continue;
+                                popped++;
+                        }
+                        else
+                                continue;
+
+                        __atomic_store_n(&slot->op, QUEUE_FC_NONE, __ATOMIC_RELEASE);
+                        done++;
+                }
+
+                /* a push may have made a pop possible, or the other way round */
+                if (!done)
+                        break;
+        }
+
+        q->combining.holds++;
+        q->combining.ops += pushed + popped;
+
+        /* Wake anyone asleep whose operation we did, or who can now go */
+        if (pushed)
+                QUEUE_FN(notify_consumer)(q);
+        if (popped)
+                QUEUE_FN(notify_producer)(q);
+
+        return pushed + popped;
+}
+
+/* Posts op in publication slot me and returns once somebody, possibly
+ * us, has carried it out */
+static inline int QUEUE_FN(fc_apply)(QUEUE_NAME *q, int me, int op)
+{
+        QUEUE_FN(fc_slot) *slot = &q->fc[me];
+        int spins = 0;
+
+        __atomic_store_n(&slot->op, op, __ATOMIC_RELEASE);
+
+        while (__atomic_load_n(&slot->op, __ATOMIC_ACQUIRE) != QUEUE_FC_NONE)
+        {
+                /* Whoever holds the lock may well do ours for us */
+                if (QUEUE_FN(trylock)(q) != 0)
+                {
+                        if (++spins < QUEUE_FC_SPINS)
+                        {
+                                sched_yield();
+                                continue;
+                        }
+                        QUEUE_FN(lock)(q);
+                }
+
+                QUEUE_FN(combine)(q);
+
+                /* Still not done, so the queue is full (or empty); sleep
+                   until the other side changes that, then combine again */
+                while (__atomic_load_n(&slot->op, __ATOMIC_ACQUIRE) != QUEUE_FC_NONE)
+                {
+                        if (op == QUEUE_FC_PUSH)
+                                QUEUE_FN(wait_for_consumer)(q, NULL);
+                        else
+                                QUEUE_FN(wait_for_producer)(q);
+                        if (__atomic_load_n(&slot->op, __ATOMIC_ACQUIRE) != QUEUE_FC_NONE)
+                                QUEUE_FN(combine)(q);
+                }
+
+                QUEUE_FN(unlock)(q);
+        }
+
+        return slot->result;
+}
+
+/* me is the caller's own publication slot, 0 to QUEUE_COMBINING - 1 */
+static inline int QUEUE_FN(fc_push)(QUEUE_NAME *q, int me, const QUEUE_TYPE *item)
+{
+        memcpy(&q->fc[me].item, item, sizeof(QUEUE_TYPE));
+        return QUEUE_FN(fc_apply)(q, me, QUEUE_FC_PUSH);
+}
+
+/* Returns -1 once the queue is closed and empty */
+static inline int QUEUE_FN(fc_pop)(QUEUE_NAME *q, int me, QUEUE_TYPE *item)
+{
+        int ret = QUEUE_FN(fc_apply)(q, me, QUEUE_FC_POP);
+
+        if (ret == 0)
+                memcpy(item, &q->fc[me].item, sizeof(QUEUE_TYPE));
+        return ret;
+}
+
+#endif /* QUEUE_COMBINING */
+
+#endif /* QUEUE_POLICY */
+
+static inline int QUEUE_FN(push)(QUEUE_NAME *q, const QUEUE_TYPE *item)
+{
+        return QUEUE_FN(offer)(q, item, QUEUE_BLOCK, 0);
+}
+
+#undef QUEUE_FN
+#undef QUEUE_NAME
+#undef QUEUE_TYPE
+#undef QUEUE_CAPACITY
+#undef QUEUE_POLICY
+#undef QUEUE_COMBINING
+#undef QUEUE_QLOCK
+#undef QUEUE_MUTEX
+#undef QUEUE_COND
@@ -0,0 +1,130 @@
+/* simd.h  Vectorised scan for runs of ready queue slots
+ * Copyright (C) 2020  William Findlay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+/* You really shouldn't be incorporating parts of this in any other code,
+   it is meant for teaching, not production */
+
+/* simd_ready_run(state, len, bit) counts how many of the first len bytes
+ * of state have bit set before the first one that doesn't. A consumer
+ * draining a queue uses it to find the run of full slots in one go,
+ * 32 (AVX2) or 16 (SSE2) slot states at a time.
+ *
+ * The version is picked the first time it is called, from what the CPU
+ * supports; other architectures, and CPUs without SSE2, get the plain
+ * loop. simd_name() says which one is in use. Scans shorter than
+ * SIMD_MIN_LEN always get the plain loop, inlined: on a 32 slot ring the
+ * call through the picked function took a drain from about 6 to about 11
+ * ns per word, while on a 1024 slot ring the AVX2 scan takes it from
+ * about 3.4 to about 1. */
+
+#ifndef SIMD_H
+#define SIMD_H
+
+#define SIMD_MIN_LEN 128
+
+typedef int (*simd_ready_run_fn)(const unsigned char *state, int len, unsigned char bit);
+
+static inline int simd_ready_run_scalar(const unsigned char *state, int len, unsigned char bit)
+{
+        int i;
+
+        for (i = 0; i < len && (state[i] & bit); i++)
+                ;
+
+        return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+__attribute__((target("sse2")))
+static int simd_ready_run_sse2(const unsigned char *state, int len, unsigned char bit)
+{
+        __m128i mask = _mm_set1_epi8(bit), zero = _mm_setzero_si128(), v;
+        unsigned int not_ready;
+        int i;
+
+        for (i = 0; i + 16 <= len; i += 16)
+        {
+                v = _mm_and_si128(_mm_loadu_si128((const __m128i *) (state + i)), mask);
+                /* one bit per byte that doesn't have bit set */
+                not_ready = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+                if (not_ready)
+                        return i + __builtin_ctz(not_ready);
+        }
+
+        return i + simd_ready_run_scalar(state + i, len - i, bit);
+}
+
+__attribute__((target("avx2")))
+static int simd_ready_run_avx2(const unsigned char *state, int len, unsigned char bit)
+{
+        __m256i mask = _mm256_set1_epi8(bit), zero = _mm256_setzero_si256(), v;
+        unsigned int not_ready;
+        int i;
+
+        for (i = 0; i + 32 <= len; i += 32)
+        {
+                v = _mm256_and_si256(_mm256_loadu_si256((const __m256i *) (state + i)), mask);
+                not_ready = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero));
+                if (not_ready)
+                        return i + __builtin_ctz(not_ready);
+        }
+
+        return i + simd_ready_run_sse2(state + i, len - i, bit);
+}
+
+#endif
+
+static simd_ready_run_fn simd_ready_run_impl;
+static const char *simd_impl_name = "scalar";
+
+static inline void simd_pick(void)
+{
+        simd_ready_run_impl = simd_ready_run_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+        {
+                simd_ready_run_impl = simd_ready_run_avx2;
+                simd_impl_name = "avx2";
+        }
+        else if (__builtin_cpu_supports("sse2"))
+        {
+                simd_ready_run_impl = simd_ready_run_sse2;
+                simd_impl_name = "sse2";
+        }
+#endif
+}
+
+static inline int simd_ready_run(const unsigned char *state, int len, unsigned char bit)
+{
+        if (len < SIMD_MIN_LEN)
+                return simd_ready_run_scalar(state, len, bit);
+        if (!simd_ready_run_impl)
+                simd_pick();
+        return simd_ready_run_impl(state, len, bit);
+}
+
+static inline const char *simd_name(void)
+{
+        if (!simd_ready_run_impl)
+                simd_pick();
+        return simd_impl_name;
+}
+
+#endif /* SIMD_H */
@@ -0,0 +1,230 @@
+/* trace.h  Binary event tracing into per-process rings in shared memory
+ * Copyright (C) 2020  William Findlay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+/* You really shouldn't be incorporating parts of this in any other code,
+   it is meant for teaching, not production */
+
+/* Tracing is only compiled in when TRACE is defined, e.g.
+ *
+ *   make CFLAGS="-O2 -Wall -DTRACE"
+ *
+ * Otherwise TRACE_EVENT() expands to nothing and the functions below do
+ * nothing, so the queues cost exactly what they did before.
+ *
+ * The parent calls trace_init() with the number of processes before
+ * forking. That maps one ring of trace_records per process in shared
+ * memory, so a process that crashes or is killed still leaves its trace
+ * behind. Each process picks its ring with trace_attach(), after which
+ * TRACE_EVENT(type, slot) costs one timestamp counter read and one 16 byte
+ * store. A full ring overwrites its oldest records. Once the children are
+ * gone the parent writes every ring to a file with trace_dump(), and
+ * 3000pc-trace2json turns that file into Chrome/Perfetto trace JSON.
+ *
+ * The file is a trace_header followed by each ring's records, oldest
+ * first. The header records how many timestamp ticks make a microsecond. */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_MAGIC 0x33303030      /* "3000" */
+
+/* Event types */
+#define TRACE_ENQUEUE        1      /* slot is the queue slot filled */
+#define TRACE_DEQUEUE        2      /* slot is the queue slot emptied */
+#define TRACE_WAIT_PRODUCER  3      /* consumer goes to sleep */
+#define TRACE_WAIT_CONSUMER  4      /* producer goes to sleep */
+#define TRACE_WOKE           5      /* ends the last wait */
+#define TRACE_SEND           6      /* slot is the number of messages sent */
+#define TRACE_RECV           7      /* slot is the number of messages received */
+
+typedef struct trace_record {
+        uint64_t tsc;
+        int32_t pid;
+        uint16_t type;
+        uint16_t slot;
+} trace_record;
+
+typedef struct trace_header {
+        uint32_t magic;
+        uint32_t records;
+        double ticks_per_us;
+} trace_header;
+
+#ifdef TRACE
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+
+/* Records per process, a power of two */
+#define TRACE_RING_SIZE (1 << 16)
+
+typedef struct trace_ring {
+        uint64_t head;          /* records written so far */
+        trace_record records[TRACE_RING_SIZE];
+} trace_ring;
+
+static trace_ring *trace_rings;
+static trace_ring *trace_current;
+static int trace_nrings;
+static int32_t trace_pid;
+static double trace_ticks_per_us = 1e-3;
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline uint64_t trace_clock(void)
+{
+        return __rdtsc();
+}
+#else
+static inline uint64_t trace_clock(void)
+{
+        struct timespec t;
+
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+#endif
+
+/* The ring is private to this process, so no atomics are needed */
+static inline void trace_event(uint16_t type, int slot)
+{
+        trace_ring *r = trace_current;
+        trace_record *rec;
+
+        if (!r)
+                return;
+        rec = &r->records[r->head & (TRACE_RING_SIZE - 1)];
+        rec->tsc = trace_clock();
+        rec->pid = trace_pid;
+        rec->type = type;
+        rec->slot = slot;
+        r->head++;
+}
+
+#define TRACE_EVENT(type, slot) trace_event((type), (slot))
+
+/* Count timestamp ticks over a short sleep */
+static inline void trace_calibrate(void)
+{
+        struct timespec start, end, pause = {0, 20 * 1000 * 1000};
+        uint64_t t0, t1;
+        double us;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        t0 = trace_clock();
+        nanosleep(&pause, NULL);
+        t1 = trace_clock();
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        us = (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3;
+        trace_ticks_per_us = (t1 - t0) / us;
+}
+
+static inline int trace_init(int processes)
+{
+        trace_rings = (trace_ring *) mmap(NULL, processes * sizeof(trace_ring),
+                                          PROT_READ|PROT_WRITE,
+                                          MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+        if (trace_rings == MAP_FAILED)
+        {
+                fprintf(stderr, "Error: Unable to mmap trace rings: %s\n", strerror(errno));
+                trace_rings = NULL;
+                return -1;
+        }
+
+        trace_nrings = processes;
+        trace_calibrate();
+        return 0;
+}
+
+/* Process number k starts writing to ring k */
+static inline void trace_attach(int k)
+{
+        if (trace_rings && k < trace_nrings)
+        {
+                trace_current = &trace_rings[k];
+                trace_pid = getpid();
+        }
+}
+
+static inline int trace_dump(const char *path)
+{
+        trace_header h;
+        trace_ring *r;
+        uint64_t n, first, i;
+        FILE *f;
+        int k;
+
+        if (!trace_rings)
+                return 0;
+
+        f = fopen(path, "w");
+        if (!f)
+        {
+                fprintf(stderr, "Error: Unable to open %s: %s\n", path, strerror(errno));
+                return -1;
+        }
+
+        h.magic = TRACE_MAGIC;
+        h.records = 0;
+        h.ticks_per_us = trace_ticks_per_us;
+        for (k = 0; k < trace_nrings; k++)
+        {
+                n = trace_rings[k].head;
+                h.records += n < TRACE_RING_SIZE ? n : TRACE_RING_SIZE;
+        }
+        fwrite(&h, sizeof(h), 1, f);
+
+        for (k = 0; k < trace_nrings; k++)
+        {
+                r = &trace_rings[k];
+                first = r->head > TRACE_RING_SIZE ? r->head - TRACE_RING_SIZE : 0;
+                for (i = first; i < r->head; i++)
+                        fwrite(&r->records[i & (TRACE_RING_SIZE - 1)], sizeof(trace_record), 1, f);
+        }
+
+        fclose(f);
+        fprintf(stderr, "Wrote %u trace records to %s\n", h.records, path);
+        return 0;
+}
+
+#else /* !TRACE */
+
+#define TRACE_EVENT(type, slot) do { } while (0)
+
+static inline int trace_init(int processes)
+{
+        return 0;
+}
+
+static inline void trace_attach(int k)
+{
+}
+
+static inline int trace_dump(const char *path)
+{
+        return 0;
+}
+
+#endif /* TRACE */
+
+#endif /* TRACE_H */
@@ -0,0 +1,153 @@
+/* transport-pipe.h  Pipe transports for 3000pc-driver
+ * Copyright (C) 2020  William Findlay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+/* You really shouldn't be incorporating parts of this in any other code,
+   it is meant for teaching, not production */
+
+/* The same pipe as 3000pc-fifo: fd[0] is the read end, fd[1] the write
+ * end. Every write is at most TRANSPORT_BATCHMAX messages, which fits in
+ * PIPE_BUF, so writes from different producers never interleave. Reads
+ * can still split a message, so more than one consumer needs
+ * "pipe-packet", as with 3000pc-fifo -P.
+ *
+ * "pipe-packet" opens the pipe with O_DIRECT so each read returns exactly
+ * one write. A read shorter than the write it meets throws the rest of the
+ * packet away, so consumers must read batches at least as big as the
+ * producers write them (the driver uses the same -b for both). */
+
+#ifndef TRANSPORT_PIPE_H
+#define TRANSPORT_PIPE_H
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+
+#include "transport.h"
+
+static inline int pipe_transport_open(transport *t, int flags)
+{
+        if (pipe2(t->fd, flags))
+        {
+                fprintf(stderr, "Error: Unable to open pipe: %s\n", strerror(errno));
+                return -1;
+        }
+
+        if (t->buffer_size > 0 && fcntl(t->fd[1], F_SETPIPE_SZ, t->buffer_size) == -1)
+                fprintf(stderr, "Error: Unable to set pipe size: %s\n", strerror(errno));
+
+        return 0;
+}
+
+static inline int pipe_transport_init(transport *t)
+{
+        return pipe_transport_open(t, 0);
+}
+
+static inline int pipe_packet_transport_init(transport *t)
+{
+        return pipe_transport_open(t, O_DIRECT);
+}
+
+/* Consumers only see the end once every copy of the write end is
+   closed, so everybody drops the end they don't use */
+static inline void pipe_transport_attach(transport *t, int role)
+{
+        if (role != TRANSPORT_PRODUCER)
+                close(t->fd[1]);
+        if (role != TRANSPORT_CONSUMER)
+                close(t->fd[0]);
+}
+
+static inline int pipe_transport_send_batch(transport *t, const message *m, int n)
+{
+        if (write(t->fd[1], m, n * sizeof(message)) == -1)
+        {
+                fprintf(stderr, "Error: Unable to write to pipe: %s\n", strerror(errno));
+                return -1;
+        }
+
+        return n;
+}
+
+static inline int pipe_transport_send(transport *t, const message *m)
+{
+        return pipe_transport_send_batch(t, m, 1);
+}
+
+/* A read from an ordinary pipe can stop partway through a message, so
+   finish off the one we started; with a second consumer reading too the
+   rest could go to it instead, which is why "pipe" takes only one */
+static inline int pipe_transport_recv_batch(transport *t, message *m, int max)
+{
+        ssize_t got, more;
+
+        got = read(t->fd[0], m, max * sizeof(message));
+        if (got == -1)
+        {
+                fprintf(stderr, "Error: Unable to read from pipe: %s\n", strerror(errno));
+                return -1;
+        }
+
+        while (got % sizeof(message))
+        {
+                more = read(t->fd[0], (char *) m + got,
+                            sizeof(message) - got % sizeof(message));
+                if (more <= 0)
+                        break;
+                got += more;
+        }
+
+        return got / sizeof(message);
+}
+
+static inline int pipe_transport_recv(transport *t, message *m)
+{
+        return pipe_transport_recv_batch(t, m, 1);
+}
+
+static inline void pipe_transport_close(transport *t, int role)
+{
+        close(t->fd[role == TRANSPORT_PRODUCER ? 1 : 0]);
+}
+
+static const transport_ops pipe_ops = {
+        .name = "pipe",
+        .description = "anonymous pipe, any number of producers x 1 consumer",
+        .max_consumers = 1,
+        .init = pipe_transport_init,
+        .attach = pipe_transport_attach,
+        .send = pipe_transport_send,
+        .send_batch = pipe_transport_send_batch,
+        .recv = pipe_transport_recv,
+        .recv_batch = pipe_transport_recv_batch,
+        .close = pipe_transport_close,
+};
+
+static const transport_ops pipe_packet_ops = {
+        .name = "pipe-packet",
+        .description = "packet mode (O_DIRECT) pipe, one write per read",
+        .init = pipe_packet_transport_init,
+        .attach = pipe_transport_attach,
+        .send = pipe_transport_send,
+        .send_batch = pipe_transport_send_batch,
+        .recv = pipe_transport_recv,
+        .recv_batch = pipe_transport_recv_batch,
+        .close = pipe_transport_close,
+};
+
+#endif /* TRANSPORT_PIPE_H */
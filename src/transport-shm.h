@@ -0,0 +1,135 @@
+/* transport-shm.h  Shared memory queue transports for 3000pc-driver
+ * Copyright (C) 2020  William Findlay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+/* You really shouldn't be incorporating parts of this in any other code,
+   it is meant for teaching, not production */
+
+/* Wraps a queue.h queue of messages in a transport. This header is a
+ * template too; define the following and then include it, once per
+ * queue policy you want to offer:
+ *
+ *   SHM_TRANSPORT_NAME    prefix for the generated functions; the
+ *                         transport_ops is called SHM_TRANSPORT_NAME_ops
+ *   SHM_TRANSPORT_LABEL   name used to pick it with --transport
+ *   SHM_TRANSPORT_POLICY  QUEUE_SPSC, QUEUE_MPSC or QUEUE_MPMC
+ *
+ * The queue lives in an anonymous shared mapping made by init(). The last
+ * producer to finish closes the queue, as in 3000mult-rendezvous-pc. */
+
+#include <stdio.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <string.h>
+
+#include "transport.h"
+
+#if !defined(SHM_TRANSPORT_NAME) || !defined(SHM_TRANSPORT_LABEL) || !defined(SHM_TRANSPORT_POLICY)
+#error "SHM_TRANSPORT_NAME, SHM_TRANSPORT_LABEL and SHM_TRANSPORT_POLICY must be defined before including transport-shm.h"
+#endif
+
+#ifndef TRANSPORT_QUEUESIZE
+#define TRANSPORT_QUEUESIZE 32
+#endif
+
+#define SHM_CAT_(a, b) a##_##b
+#define SHM_CAT(a, b) SHM_CAT_(a, b)
+#define SHM_FN(fn) SHM_CAT(SHM_TRANSPORT_NAME, fn)
+
+#define QUEUE_NAME     SHM_FN(queue)
+#define QUEUE_TYPE     message
+#define QUEUE_CAPACITY TRANSPORT_QUEUESIZE
+#define QUEUE_POLICY   SHM_TRANSPORT_POLICY
+#include "queue.h"
+
+typedef struct SHM_FN(shared) {
+        SHM_FN(queue) queue;
+        int producers_left;
+} SHM_FN(shared);
+
+static inline int SHM_FN(init)(transport *t)
+{
+        SHM_FN(shared) *s;
+
+        s = (SHM_FN(shared) *) mmap(NULL, sizeof(SHM_FN(shared)),
+                                    PROT_READ|PROT_WRITE,
+                                    MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+
+        if (s == MAP_FAILED)
+        {
+                fprintf(stderr, "Error: Unable to mmap: %s\n", strerror(errno));
+                return -1;
+        }
+
+        SHM_CAT(SHM_FN(queue), init)(&s->queue);
+        s->producers_left = t->producers;
+        t->shared = s;
+        return 0;
+}
+
+static inline int SHM_FN(send)(transport *t, const message *m)
+{
+        SHM_FN(shared) *s = t->shared;
+
+        return SHM_CAT(SHM_FN(queue), push)(&s->queue, m) == 0;
+}
+
+static inline int SHM_FN(recv)(transport *t, message *m)
+{
+        SHM_FN(shared) *s = t->shared;
+
+        return SHM_CAT(SHM_FN(queue), pop)(&s->queue, m) == 0;
+}
+
+static inline int SHM_FN(recv_batch)(transport *t, message *m, int max)
+{
+        SHM_FN(shared) *s = t->shared;
+        int n = SHM_CAT(SHM_FN(queue), drain)(&s->queue, m, max);
+
+        return n < 0 ? 0 : n;
+}
+
+static inline void SHM_FN(close)(transport *t, int role)
+{
+        SHM_FN(shared) *s = t->shared;
+
+        if (role == TRANSPORT_PRODUCER &&
+            __atomic_sub_fetch(&s->producers_left, 1, __ATOMIC_ACQ_REL) == 0)
+                SHM_CAT(SHM_FN(queue), close)(&s->queue);
+}
+
+static const transport_ops SHM_FN(ops) = {
+        .name = SHM_TRANSPORT_LABEL,
+#if SHM_TRANSPORT_POLICY == QUEUE_SPSC
+        .description = "shared memory queue, per-slot lock bits, 1 producer x 1 consumer",
+        .max_producers = 1,
+        .max_consumers = 1,
+#elif SHM_TRANSPORT_POLICY == QUEUE_MPSC
+        .description = "shared memory queue, one mutex, many producers x 1 consumer",
+        .max_consumers = 1,
+#else
+        .description = "shared memory queue, one mutex, many producers x many consumers",
+#endif
+        .init = SHM_FN(init),
+        .send = SHM_FN(send),
+        .recv = SHM_FN(recv),
+        .recv_batch = SHM_FN(recv_batch),
+        .close = SHM_FN(close),
+};
+
+#undef SHM_FN
+#undef SHM_TRANSPORT_NAME
+#undef SHM_TRANSPORT_LABEL
+#undef SHM_TRANSPORT_POLICY
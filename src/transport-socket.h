@@ -0,0 +1,171 @@
+/* transport-socket.h  Unix domain socket transport for 3000pc-driver
+ * Copyright (C) 2020  William Findlay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+/* You really shouldn't be incorporating parts of this in any other code,
+   it is meant for teaching, not production */
+
+/* A Unix domain SOCK_SEQPACKET socket pair: fd[0] is the producers' end
+ * and fd[1] the consumers'. Each message is its own packet, so message
+ * boundaries survive any number of producers and consumers, and batches
+ * go out and come in with one sendmmsg/recvmmsg. Run it with
+ * 3000pc-driver --transport=socket; -s sets both buffer sizes. */
+
+#ifndef TRANSPORT_SOCKET_H
+#define TRANSPORT_SOCKET_H
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <string.h>
+
+#include "transport.h"
+
+static inline void socket_transport_set_buffer(int sock, int option, int size, char *name)
+{
+        if (size > 0 && setsockopt(sock, SOL_SOCKET, option, &size, sizeof(size)) == -1)
+                fprintf(stderr, "Error: Unable to set %s size: %s\n", name, strerror(errno));
+}
+
+static inline int socket_transport_init(transport *t)
+{
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, t->fd))
+        {
+                fprintf(stderr, "Error: Unable to create socket pair: %s\n", strerror(errno));
+                return -1;
+        }
+
+        socket_transport_set_buffer(t->fd[0], SO_SNDBUF, t->buffer_size, "send buffer");
+        socket_transport_set_buffer(t->fd[1], SO_RCVBUF, t->buffer_size, "receive buffer");
+        return 0;
+}
+
+static inline void socket_transport_attach(transport *t, int role)
+{
+        if (role != TRANSPORT_PRODUCER)
+                close(t->fd[0]);
+        if (role != TRANSPORT_CONSUMER)
+                close(t->fd[1]);
+}
+
+/* Point one iovec and message header at each of the n messages */
+static inline void socket_transport_vectors(struct mmsghdr *msgs, struct iovec *iovs,
+                                            const message *m, int n)
+{
+        int i;
+
+        memset(msgs, 0, n * sizeof(msgs[0]));
+        for (i = 0; i < n; i++)
+        {
+                iovs[i].iov_base = (void *) &m[i];
+                iovs[i].iov_len = sizeof(message);
+                msgs[i].msg_hdr.msg_iov = &iovs[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+}
+
+static inline int socket_transport_send_batch(transport *t, const message *m, int n)
+{
+        struct mmsghdr msgs[TRANSPORT_BATCHMAX];
+        struct iovec iovs[TRANSPORT_BATCHMAX];
+        int sent = 0, ret;
+
+        socket_transport_vectors(msgs, iovs, m, n);
+
+        /* sendmmsg may stop early if the socket buffer fills up */
+        while (sent < n)
+        {
+                ret = sendmmsg(t->fd[0], msgs + sent, n - sent, 0);
+                if (ret == -1)
+                {
+                        fprintf(stderr, "Error: Unable to send to socket: %s\n", strerror(errno));
+                        return -1;
+                }
+                sent += ret;
+        }
+
+        return n;
+}
+
+static inline int socket_transport_send(transport *t, const message *m)
+{
+        if (send(t->fd[0], m, sizeof(message), 0) == -1)
+        {
+                fprintf(stderr, "Error: Unable to send to socket: %s\n", strerror(errno));
+                return -1;
+        }
+
+        return 1;
+}
+
+static inline int socket_transport_recv_batch(transport *t, message *m, int max)
+{
+        struct mmsghdr msgs[TRANSPORT_BATCHMAX];
+        struct iovec iovs[TRANSPORT_BATCHMAX];
+        int i, n;
+
+        socket_transport_vectors(msgs, iovs, m, max);
+
+        /* Block for the first message, then take whatever else is queued */
+        n = recvmmsg(t->fd[1], msgs, max, MSG_WAITFORONE, NULL);
+        if (n == -1)
+        {
+                fprintf(stderr, "Error: Unable to receive from socket: %s\n", strerror(errno));
+                return -1;
+        }
+
+        /* Once the other end is closed every receive returns a zero
+           length message, so stop counting at the first one */
+        for (i = 0; i < n; i++)
+        {
+                if (msgs[i].msg_len == 0)
+                        return i;
+        }
+
+        return n;
+}
+
+static inline int socket_transport_recv(transport *t, message *m)
+{
+        ssize_t got = recv(t->fd[1], m, sizeof(message), 0);
+
+        if (got == -1)
+        {
+                fprintf(stderr, "Error: Unable to receive from socket: %s\n", strerror(errno));
+                return -1;
+        }
+
+        return got > 0;
+}
+
+static inline void socket_transport_close(transport *t, int role)
+{
+        close(t->fd[role == TRANSPORT_PRODUCER ? 0 : 1]);
+}
+
+static const transport_ops socket_ops = {
+        .name = "socket",
+        .description = "Unix domain SOCK_SEQPACKET socket pair",
+        .init = socket_transport_init,
+        .attach = socket_transport_attach,
+        .send = socket_transport_send,
+        .send_batch = socket_transport_send_batch,
+        .recv = socket_transport_recv,
+        .recv_batch = socket_transport_recv_batch,
+        .close = socket_transport_close,
+};
+
+#endif /* TRANSPORT_SOCKET_H */
@@ -0,0 +1,85 @@
+/* transport.h  Interface between 3000pc-driver and the ways of moving words
+ * Copyright (C) 2020  William Findlay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+/* You really shouldn't be incorporating parts of this in any other code,
+   it is meant for teaching, not production */
+
+/* A transport is a table of operations (transport_ops) plus the state
+ * they work on (transport). The driver calls them in this order:
+ *
+ *   init()         once, in the parent, before anything is forked
+ *   attach()       in every process after the fork, with its role;
+ *                  the parent attaches as TRANSPORT_PARENT
+ *   send()/send_batch() or recv()/recv_batch()
+ *                  from producers and consumers respectively
+ *   close()        when a producer or consumer is done
+ *
+ * recv() and recv_batch() block until there is at least one message and
+ * return how many they got, 0 once every producer has closed and all
+ * messages are gone, or -1 on error. send_batch and recv_batch may be
+ * NULL, in which case the driver falls back to one message at a time.
+ *
+ * To add a transport, write its operations in a transport-*.h header and
+ * add its transport_ops to the table in 3000pc-driver.c. */
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <time.h>
+
+#include "words.h"
+#include "proc.h"
+
+/* Most messages moved by one send_batch or recv_batch */
+#define TRANSPORT_BATCHMAX 64
+
+#define TRANSPORT_PARENT   0
+#define TRANSPORT_PRODUCER 1
+#define TRANSPORT_CONSUMER 2
+
+/* What every transport carries; the send time lets the driver measure
+   latency the same way for all of them */
+typedef struct message {
+        word_t word;
+        long sent_ns;
+} message;
+
+typedef struct transport transport;
+
+typedef struct transport_ops {
+        const char *name;
+        const char *description;
+        int max_producers;      /* 0 means no limit */
+        int max_consumers;
+        int  (*init)(transport *t);
+        void (*attach)(transport *t, int role);
+        int  (*send)(transport *t, const message *m);
+        int  (*send_batch)(transport *t, const message *m, int n);
+        int  (*recv)(transport *t, message *m);
+        int  (*recv_batch)(transport *t, message *m, int max);
+        void (*close)(transport *t, int role);
+} transport_ops;
+
+struct transport {
+        const transport_ops *ops;
+        int producers;
+        int consumers;
+        int buffer_size;        /* pipe or socket buffer size, 0 = default */
+        int fd[2];              /* for transports built on file descriptors */
+        void *shared;           /* for transports built on shared memory */
+};
+
+#endif /* TRANSPORT_H */
@@ -0,0 +1,113 @@
+/* words.h  Word generation and output shared by the producer-consumer programs
+ * Original Version Copyright (C) 2017  Anil Somayaji
+ * Modified Version Copyright (C) 2020  William Findlay
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+/* You really shouldn't be incorporating parts of this in any other code,
+   it is meant for teaching, not production */
+
+#ifndef WORDS_H
+#define WORDS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+
+#define WORDSIZE 16
+
+/* A word always occupies WORDSIZE bytes, NUL padded */
+typedef char word_t[WORDSIZE];
+
+static const int wordlist_size = 27;
+/* Stored as whole NUL padded words so picking one is a single 16 byte copy */
+static const word_t wordlist[] = {
+        "Alpha",
+        "Bravo",
+        "Charlie",
+        "Delta",
+        "Echo",
+        "Foxtrot",
+        "Golf",
+        "Hotel",
+        "India",
+        "Juliet",
+        "Kilo",
+        "Lima",
+        "Mike",
+        "November",
+        "Oscar",
+        "Papa",
+        "Quebec",
+        "Romeo",
+        "Sierra",
+        "Tango",
+        "Uniform",
+        "Victor",
+        "Whiskey",
+        "X-ray",
+        "Yankee",
+        "Zulu",
+        "Dash"
+};
+
+static inline void report_error(char *error)
+{
+        fprintf(stderr, "Error: %s\n", error);
+}
+
+/* Pick a word using /dev/urandom */
+static inline void pick_word(char *word)
+{
+        unsigned int pick;
+
+        /* Open /dev/urandom for reading */
+        int fd = open("/dev/urandom", O_RDONLY);
+        if (fd < 0)
+        {
+                fprintf(stderr, "Error: Unable to open /dev/urandom for reading: %s\n", strerror(errno));
+                pick = 0;
+        }
+        else if (read(fd, (void *)&pick, sizeof(pick)) == -1)
+        {
+                fprintf(stderr, "Error: Unable to read from /dev/urandom: %s\n",strerror(errno));
+                pick = 0;
+        }
+
+        pick = pick % wordlist_size;
+
+        memcpy(word, wordlist[pick], WORDSIZE);
+
+        close(fd);
+}
+
+/* Pick a word using the C library's random(), seeded by the caller */
+static inline void pick_random_word(char *word)
+{
+        int pick;
+
+        pick = random() % wordlist_size;
+
+        memcpy(word, wordlist[pick], WORDSIZE);
+}
+
+static inline void output_word(int c, char *w)
+{
+        printf("Word %d: %s\n", c, w);
+}
+
+#endif /* WORDS_H */